@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pkg/parser/parser.h"
+
+// Measures the throughput of getCmds on synthetic command streams. Every
+// scenario builds a stream in memory and parses it through a string Reader,
+// so the numbers do not include any I/O.
+//
+// usage: parse_bench [size_kib]
+// size_kib is the approximate size of every stream, 1024 by default.
+
+typedef struct Buf {
+  char* data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+void bufAppend(Buf* b, const char* s, size_t len) {
+  if (b->len + len + 1 > b->cap) {
+    b->cap = (b->len + len + 1) * 2;
+    b->data = realloc(b->data, b->cap);
+    if (b->data == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+  b->data[b->len] = '\0';
+}
+
+void bufAppendStr(Buf* b, const char* s) {
+  bufAppend(b, s, strlen(s));
+}
+
+// Short everyday lines.
+void genSimple(Buf* b, size_t size) {
+  while (b->len < size) {
+    bufAppendStr(b, "ls -la /tmp | grep 'foo bar' > out.txt && echo \"done $?\"\n");
+  }
+}
+
+// One line with a single quoted word of the whole size.
+void genLongQuote(Buf* b, size_t size) {
+  bufAppendStr(b, "echo \"");
+  while (b->len < size) {
+    bufAppendStr(b, "0123456789abcdef");
+  }
+  bufAppendStr(b, "\"\n");
+}
+
+// Lines of words made of escaped characters.
+void genEscapes(Buf* b, size_t size) {
+  while (b->len < size) {
+    bufAppendStr(b, "echo a\\ b\\ c \"x\\\"y\\\\z\" \\$\\?\\'\\\"\\|\\&\n");
+  }
+}
+
+// Long pipelines of 100 stages.
+void genPipes(Buf* b, size_t size) {
+  while (b->len < size) {
+    bufAppendStr(b, "cat");
+    for (int i = 0; i < 99; ++i) {
+      bufAppendStr(b, " | cat");
+    }
+    bufAppendStr(b, "\n");
+  }
+}
+
+// A double-quoted string continued over many physical lines, like a pasted
+// JSON document.
+void genMultiline(Buf* b, size_t size) {
+  bufAppendStr(b, "echo '");
+  while (b->len < size) {
+    bufAppendStr(b, "  {\"key\": \"value\", \"n\": 12345},\n");
+  }
+  bufAppendStr(b, "'\n");
+}
+
+// Lines joined by a trailing backslash.
+void genContinued(Buf* b, size_t size) {
+  while (b->len < size) {
+    bufAppendStr(b, "echo one two three \\\n");
+  }
+  bufAppendStr(b, "end\n");
+}
+
+typedef struct Scenario {
+  const char* name;
+  void (*gen)(Buf* b, size_t size);
+} Scenario;
+
+static const Scenario scenarios[] = {
+  {"simple", genSimple},
+  {"long_quote", genLongQuote},
+  {"escapes", genEscapes},
+  {"pipes", genPipes},
+  {"multiline", genMultiline},
+  {"continued", genContinued},
+};
+
+double nowSec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024) * 1024;
+  printf("%-12s %12s %10s %10s %10s\n", "scenario", "bytes", "commands", "seconds", "MB/s");
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+    Buf b = {NULL, 0, 0};
+    scenarios[i].gen(&b, size);
+    Reader reader;
+    readerOpenString(&reader, b.data);
+    size_t commands = 0;
+    double start = nowSec();
+    while (true) {
+      Cmd* cmds = NULL;
+      ssize_t n = getCmds(&cmds, &reader);
+      if (n == -1) {
+        break;
+      }
+      if (n >= 0) {
+        commands += n;
+        cmdFree(cmds, n);
+      }
+    }
+    double elapsed = nowSec() - start;
+    printf("%-12s %12zu %10zu %10.3f %10.1f\n", scenarios[i].name, b.len, commands,
+        elapsed, b.len / elapsed / 1e6);
+    readerClose(&reader);
+    free(b.data);
+  }
+  return 0;
+}
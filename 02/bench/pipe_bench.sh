@@ -0,0 +1,63 @@
+#!/bin/sh
+# Times pipelines and redirections moving a large volume of data through the
+# shell, next to the same command lines run by a reference shell.
+#
+# usage: bench/pipe_bench.sh [size_mib] [shell]
+# size_mib is the size of the input file, 1024 by default. shell is the shell
+# under test, ./task_2 by default. The reference shell is $REF_SHELL or /bin/sh.
+
+set -e
+
+SIZE_MIB=${1:-1024}
+SHELL_BIN=${2:-./task_2}
+REF_SHELL=${REF_SHELL:-/bin/sh}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+yes 'the quick brown fox jumps over the lazy dog 0123456789' |
+  head -c $((SIZE_MIB * 1024 * 1024)) > "$DIR/in"
+
+now() {
+  date +%s%N
+}
+
+# run name bytes command
+# bytes is how much data the command moves, 0 for a command not streaming the
+# input file, which gets no MB/s.
+run() {
+  name=$1
+  bytes=$2
+  cmd=$3
+  printf '%-14s' "$name"
+  for sh in "$SHELL_BIN" "$REF_SHELL"; do
+    start=$(now)
+    (cd "$DIR" && "$sh" -c "$cmd") > /dev/null
+    end=$(now)
+    usec=$(((end - start) / 1000))
+    if [ "$bytes" -eq 0 ]; then
+      printf ' %10d %10s' "$usec" -
+    else
+      printf ' %10d %10d' "$usec" $((bytes / (usec + 1)))
+    fi
+    rm -f "$DIR/out"
+  done
+  printf '\n'
+}
+
+case "$SHELL_BIN" in
+  /*) ;;
+  *) SHELL_BIN=$(pwd)/$SHELL_BIN ;;
+esac
+
+SIZE=$((SIZE_MIB * 1048576))
+
+printf '%-14s %10s %10s %10s %10s\n' scenario us MB/s ref_us ref_MB/s
+run cat_wc      $SIZE       'cat in | wc -l'
+run pipe4       $SIZE       'cat in | cat | cat | wc -c'
+run redir_out   $SIZE       'cat in > out'
+run redir_in    $SIZE       'wc -c < in'
+run redir_both  $SIZE       'cat < in > out'
+run redir_app   $((2 * SIZE)) 'cat in >> out; cat in >> out'
+run heredoc     0           'cat <<EOF | wc -c
+small here-document
+EOF'
@@ -13,9 +13,17 @@ parser.add_argument('--max', type=int, choices=[15, 20, 25], default=15,
 		    help='max points number')
 args = parser.parse_args()
 
+# testdir/bin and testdir/bin2 are searched first, for the tests of the
+# command path cache.
+env = dict(os.environ)
+env['PATH'] = '{0}/bin:{0}/bin2:{1}'.format(os.path.abspath('testdir'),
+					    env.get('PATH', ''))
 p = subprocess.Popen([args.e], shell=False, stdin=subprocess.PIPE,
 		     stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
-		     bufsize=0)
+		     bufsize=0, env=env)
+
+# Absolute path of the shell, for tests starting a copy of it.
+shell = os.path.abspath(args.e)
 
 tests = [
 [
@@ -64,7 +72,89 @@ tests = [
 "sleep 0.5 && echo 'back sleep is done' &",
 "echo 'next sleep is done'",
 "sleep 0.5",
-]
+],
+[
+"mkdir bin bin2",
+"echo 'echo script without interpreter line' > bin/tool",
+"chmod +x bin/tool",
+"tool",
+"echo 'echo found again' > bin2/tool",
+"chmod +x bin2/tool",
+"rm bin/tool",
+"tool",
+"no_such_command_here; echo $?",
+],
+[
+"sleep 0.3 &",
+"jobs",
+"wait",
+"jobs",
+"head -c 300000 /dev/zero | cat | wc -c",
+"false & wait; echo $?",
+"wait %5; echo $?",
+"sleep 10 & kill -STOP %1; kill -9 %1; sleep 0.2; jobs",
+],
+[
+shell + " -c 'echo from -c; echo second'",
+"printf 'echo from a script\\n\\necho after a blank line\\n' > script.sh",
+"cat script.sh",
+shell + " script.sh",
+"",
+"echo after a blank line of the stream",
+"printf 'echo without a final newline' > tail.sh",
+shell + " tail.sh",
+"printf 'cat\\nhello\\n' > stdin.sh",
+shell + " < stdin.sh",
+],
+[
+"true && echo and-ran || echo or-ran",
+"false && echo and-ran || echo or-ran",
+"false || false || echo last-or",
+"true || echo skipped; echo $?",
+"false; echo $?; echo $?",
+shell + " -c 'exit 7'; echo $?",
+shell + " -c 'exit 3' || echo status $?",
+shell + " -c false; echo $?",
+shell + " -c 'false; true'; echo $?",
+"printf 'echo in script\\nfalse\\n' > fails.sh",
+shell + " fails.sh; echo $?",
+shell + " -c 'echo >' 2> /dev/null; echo $?",
+],
+[
+shell + " -T 3 -c 'echo x | cat; false' 3> trace.json",
+"sed -E 's/,\"(pid|background)\".*//' trace.json | sort",
+],
+[
+"echo out > f1; echo more >> f1; cat < f1",
+"sh -c 'echo to-err >&2; echo to-out' > f2 2>&1; cat f2",
+"sh -c 'echo to-err >&2' 2>&1 > f3 | tr a-z A-Z; cat f3",
+"echo through-three 3> f4 1>&3; cat f4",
+"cat 3< f1 0<&3",
+"false; echo status > st$?; cat st1",
+"false; sh -c 'echo via-status >&2' 2>&$? | tr a-z A-Z",
+"true; cat < missing$?; echo $?",
+"cat <<EOF\nline one\n  line two\nEOF",
+"cat <<END | tr a-z A-Z\nupper\nEND",
+"cat <<A; cat <<B\nfirst\nA\nsecond\nB",
+"cat <<'$?'\nliteral delimiter\n$?",
+shell + " -c \"sh -c 'echo to6 >&6; echo to5 >&5' 6> f6 5> f5\"; grep . f6 f5",
+],
+[
+"parallel -j 1 echo item ::: 1 2 3",
+"parallel -j 2 echo {} done ::: c a b | sort",
+"printf 'x\\ny\\n' | parallel echo line | sort",
+"parallel -j 3 sh -c 'exit $0' ::: 0 1 2; echo $?",
+"parallel -j 0 echo; echo $?",
+],
+[
+"echo a'b c'",
+"echo a\\\\",
+"echo 'x\\'",
+"echo \"y\\\\\"",
+"echo one \\\ntwo",
+"echo 'a|b' \"c;d\" e\\&f",
+"echo 'first\nsecond'",
+],
 ]
 
 def finish(code):
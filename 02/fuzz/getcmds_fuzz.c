@@ -0,0 +1,34 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pkg/parser/parser.h"
+
+// libFuzzer entry point: parses the input as a command stream until its end.
+// Built with AddressSanitizer by make fuzz, it catches out of bounds accesses
+// and leaks in the lexer, the line assembly and here-document reading.
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  char* s = malloc(size + 1);
+  if (s == NULL) {
+    return 0;
+  }
+  memcpy(s, data, size);
+  s[size] = '\0';
+  Reader reader;
+  readerOpenString(&reader, s);
+  while (true) {
+    Cmd* cmds = NULL;
+    ssize_t n = getCmds(&cmds, &reader);
+    if (n == -1) {
+      break;
+    }
+    if (n >= 0) {
+      cmdFree(cmds, n);
+    }
+  }
+  readerClose(&reader);
+  free(s);
+  return 0;
+}
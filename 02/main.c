@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "./pkg/parser/parser.h"
 #include "./pkg/strings/strings.h"
+#include "./pkg/launcher/launcher.h"
+#include "./pkg/jobs/jobs.h"
+#include "./pkg/trace/trace.h"
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -17,174 +22,870 @@ void terminateIfError(const char* msg, int err) {
   }
 }
 
-void runCmd(Cmd* cmds, ssize_t n) {
-  if (n < 1) {
-    return;
+// Opens the file of a redirection, or a memory file holding the body of
+// a here-document. The descriptor is close-on-exec and not below 10, commands
+// get it only through a copy made by the redirection. Returns -1 after printing an error.
+int openRedirect(const Redirect* r) {
+  int fd = -1;
+  switch (r->kind) {
+    case RedirIn:
+      fd = open(r->target, O_RDONLY | O_CLOEXEC);
+      break;
+    case RedirOut:
+      fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IWUSR | S_IRUSR);
+      break;
+    case RedirAppend:
+      fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IWUSR | S_IRUSR);
+      break;
+    case RedirHeredoc:
+      fd = memfd_create("heredoc", MFD_CLOEXEC);
+      if (fd != -1 && (write(fd, r->body, r->bodyLen) != (ssize_t)r->bodyLen ||
+                       lseek(fd, 0, SEEK_SET) == -1)) {
+        close(fd);
+        fd = -1;
+      }
+      break;
+    case RedirDup:
+      break;
   }
-  if (strcmp(cmds->command, "cd") == 0) {
-    int err = chdir(cmds->argv[1]);
-    terminateIfError("cd", err);
-    return;
+  if (fd != -1) {
+    // Move the file above the descriptors redirections usually name, as bash
+    // does, so a copy made for one redirection does not overwrite the file of
+    // another one before it is copied.
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    fd = high;
   }
-  if (strcmp(cmds[n-1].command, "&") == 0) {
-    pid_t pid = fork();
-    if (pid == 0) {
-      runCmd(cmds, n-1);
-      exit(0);
-    }
-    return;
+  if (fd == -1) {
+    perror(r->kind == RedirHeredoc ? "here-document" : r->target);
   }
-  int status = 0;
-  int err = 0;
-  int in = STDIN_FILENO;
-  for (int i = 0; i < n; ++i) {
-    if (i > 1 && strcmp(cmds[i-1].command, "||") == 0) {
-      pid_t pid = fork();
-      if (pid == 0) {
-        if (strcmp(cmds[i-1].command, "|") == 0) {
-          dup2(in, STDIN_FILENO);
-        }
-        err = execvp(cmds[i].command, cmds[i].argv);
-        if (err == -1) {
-          exit(EXIT_FAILURE);
-        }
+  return fd;
+}
+
+// Opens the redirections of cmd and appends an action per redirection to
+// actions. Opened files are stored into files and must be closed by the caller
+// once the command is started. Returns the number of opened files, or -1 after
+// printing an error, with nothing left open.
+ssize_t openRedirects(const Cmd* cmd, FdAction* actions, size_t* actionCount, RedirFile* files) {
+  size_t count = 0;
+  for (size_t i = 0; i < cmd->redirCount; ++i) {
+    const Redirect* r = &cmd->redirs[i];
+    FdAction* a = &actions[(*actionCount)++];
+    a->fd = r->fd;
+    if (r->kind == RedirDup) {
+      char* end = NULL;
+      a->src = strcmp(r->target, "-") == 0 ? -1 : strtol(r->target, &end, 10);
+      if (end == NULL || (end != r->target && *end == '\0')) {
+        continue;
       }
-      int locStatus;
-      err = waitpid(pid, &locStatus, 0);
-      terminateIfError("waitpid", err);
-      if (WEXITSTATUS(status) == 1) {
-        status = locStatus;
+      // Only a target with $? is left unchecked by the parser.
+      fprintf(stderr, "%s: ambiguous redirect\n", r->target);
+      a->src = -1;
+    } else {
+      a->src = openRedirect(r);
+    }
+    if (a->src == -1) {
+      while (count > 0) {
+        close(files[--count].fd);
       }
+      return -1;
+    }
+    struct stat st;
+    files[count].fd = a->src;
+    files[count].start = r->kind == RedirAppend && fstat(a->src, &st) == 0 ? st.st_size : 0;
+    ++count;
+  }
+  return count;
+}
+
+void closeRedirects(RedirFile* files, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    terminateIfError("file", close(files[i].fd));
+  }
+}
+
+// Applies actions to the shell itself, for a builtin run without forking.
+// The replaced descriptors are saved into saved to be put back by restoreFds.
+void applyFds(const FdAction* actions, size_t count, int* saved) {
+  fflush(stdout);
+  for (size_t i = 0; i < count; ++i) {
+    saved[i] = fcntl(actions[i].fd, F_DUPFD_CLOEXEC, 10);
+    if (actions[i].src == -1) {
+      close(actions[i].fd);
+    } else if (dup2(actions[i].src, actions[i].fd) == -1) {
+      perror("dup2");
+    }
+  }
+}
+
+void restoreFds(const FdAction* actions, size_t count, const int* saved) {
+  fflush(stdout);
+  for (size_t i = count; i > 0; --i) {
+    if (saved[i - 1] == -1) {
+      close(actions[i - 1].fd);
       continue;
     }
-    if(WEXITSTATUS(status) == 1 && strcmp(cmds[i].command, "||") != 0) {
-      return;
-    };
-    if (i + 1 < n && strcmp(cmds[i+1].command, "|") == 0) {
-      int fd[2];
-      err = pipe(fd);
-      terminateIfError("pipe", err);
-      pid_t pid = fork();
-      if (pid == 0) {
-        err = close(fd[0]);
-        terminateIfError("file", err);
-        if (i > 1 && strcmp(cmds[i-1].command, "|") == 0) {
-          dup2(in, STDIN_FILENO);
-        }
-        dup2(fd[1], STDOUT_FILENO);
-        err = execvp(cmds[i].command, cmds[i].argv);
-        if (err == -1) {
-          exit(EXIT_FAILURE);
-        }
+    dup2(saved[i - 1], actions[i - 1].fd);
+    close(saved[i - 1]);
+  }
+}
+
+bool isOp(const Cmd* cmd, const char* op) {
+  return cmd->type == Operator && strcmp(cmd->command, op) == 0;
+}
+
+void writeWord(FILE* out, const char* word) {
+  for (; *word != '\0'; ++word) {
+    if (*word == StatusMarker) {
+      fputs("$?", out);
+    } else {
+      fputc(*word, out);
+    }
+  }
+}
+
+// Restores a command line from its tokens for the jobs output.
+char* cmdText(const Cmd* cmds, size_t n) {
+  char* text = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&text, &len);
+  if (out == NULL) {
+    perror("open_memstream");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    const char* sep = i == 0 ? "" : " ";
+    if (cmds[i].argc == 0 && cmds[i].redirCount == 0) {
+      fputs(sep, out);
+      writeWord(out, cmds[i].command);
+    }
+    for (size_t j = 0; j < cmds[i].argc; ++j, sep = " ") {
+      fputs(sep, out);
+      writeWord(out, cmds[i].argv[j]);
+    }
+    for (size_t j = 0; j < cmds[i].redirCount; ++j, sep = " ") {
+      fprintf(out, "%s%s%s", sep, cmds[i].redirs[j].op,
+          cmds[i].redirs[j].kind == RedirHeredoc ? "" : " ");
+      writeWord(out, cmds[i].redirs[j].target);
+    }
+  }
+  fclose(out);
+  return text;
+}
+
+// Exit status of the last pipeline, the value of $?.
+static int lastStatus = 0;
+
+// Returns word with $? substituted, or word itself if it has no $?.
+char* expandWord(char* word) {
+  size_t markers = 0;
+  for (const char* c = word; *c != '\0'; ++c) {
+    markers += *c == StatusMarker;
+  }
+  if (markers == 0) {
+    return word;
+  }
+  char status[16];
+  size_t statusLen = snprintf(status, sizeof(status), "%d", lastStatus);
+  char* res = malloc(strlen(word) + markers * statusLen + 1);
+  if (res == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  char* p = res;
+  for (const char* c = word; *c != '\0'; ++c) {
+    if (*c == StatusMarker) {
+      memcpy(p, status, statusLen);
+      p += statusLen;
+    } else {
+      *p++ = *c;
+    }
+  }
+  *p = '\0';
+  return res;
+}
+
+// Returns cmd with $? substituted in its arguments and redirection targets.
+// Words without $? and the command itself are shared with cmd, so the result
+// is freed with expandFree.
+void expandCmd(const Cmd* cmd, Cmd* expanded) {
+  *expanded = *cmd;
+  bool found = false;
+  for (size_t i = 0; i < cmd->argc && !found; ++i) {
+    found = strchr(cmd->argv[i], StatusMarker) != NULL;
+  }
+  if (found) {
+    expanded->argv = malloc((cmd->argc + 1) * sizeof(char*));
+    if (expanded->argv == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < cmd->argc; ++i) {
+      expanded->argv[i] = expandWord(cmd->argv[i]);
+    }
+    expanded->argv[cmd->argc] = NULL;
+    expanded->command = expanded->argv[0];
+  }
+  found = false;
+  for (size_t i = 0; i < cmd->redirCount && !found; ++i) {
+    found = strchr(cmd->redirs[i].target, StatusMarker) != NULL;
+  }
+  if (found) {
+    expanded->redirs = malloc(cmd->redirCount * sizeof(Redirect));
+    if (expanded->redirs == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < cmd->redirCount; ++i) {
+      expanded->redirs[i] = cmd->redirs[i];
+      expanded->redirs[i].target = expandWord(cmd->redirs[i].target);
+    }
+  }
+}
+
+void expandFree(const Cmd* cmd, Cmd* expanded) {
+  if (expanded->argv != cmd->argv) {
+    for (size_t i = 0; i < cmd->argc; ++i) {
+      if (expanded->argv[i] != cmd->argv[i]) {
+        free(expanded->argv[i]);
       }
-      err =  close(fd[1]);
-      terminateIfError("file", err);
-      err = waitpid(pid, &status, 0);
-      terminateIfError("waitpid", err);
-      if (in != STDIN_FILENO) {
-        err = close(in);
-        terminateIfError("file", err);
+    }
+    free(expanded->argv);
+  }
+  if (expanded->redirs != cmd->redirs) {
+    for (size_t i = 0; i < cmd->redirCount; ++i) {
+      if (expanded->redirs[i].target != cmd->redirs[i].target) {
+        free(expanded->redirs[i].target);
       }
-      in = fd[0];
-      ++i;
-    } else if (i + 2 < n && strcmp(cmds[i+1].command, ">>") == 0) {
-      int fd[2];
-      err = pipe(fd);
-      terminateIfError("pipe", err);
-      pid_t pid = fork();
-      if (pid == 0) {
-        err = close(fd[0]);
-        terminateIfError("file", err);
-        if (i > 1 && strcmp(cmds[i-1].command, "|") == 0) {
-          dup2(in, STDIN_FILENO);
-        }
-        dup2(fd[1], STDOUT_FILENO);
-        err = execvp(cmds[i].command, cmds[i].argv);
-        if (err == -1) {
-          exit(EXIT_FAILURE);
+    }
+    free(expanded->redirs);
+  }
+}
+
+int builtinCd(Cmd* cmd) {
+  const char* dir = cmd->argc > 1 ? cmd->argv[1] : getenv("HOME");
+  if (dir == NULL || chdir(dir) == -1) {
+    perror("cd");
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
+int builtinExit(Cmd* cmd) {
+  exit(cmd->argc > 1 ? atoi(cmd->argv[1]) : lastStatus);
+}
+
+int builtinHash(Cmd* cmd) {
+  if (cmd->argc > 1 && strcmp(cmd->argv[1], "-r") == 0) {
+    pathCacheClear();
+  } else {
+    pathCachePrint(stdout);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+int builtinJobs(Cmd* cmd) {
+  while (jobsReapOne(false)) {}
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    Job* job = &jobTable.jobs[i];
+    if (job->id == 0) {
+      continue;
+    }
+    jobPrint(job, stdout);
+    if (jobState(job) == Done) {
+      jobDone(job);
+    }
+  }
+  fflush(stdout);
+  return 0;
+}
+
+// Waits for the given jobs or for all of them. Returns the exit code of the
+// last waited job.
+int builtinWait(Cmd* cmd) {
+  int status = 0;
+  if (cmd->argc < 2) {
+    for (size_t i = 0; i < jobTable.cap; ++i) {
+      Job* job = &jobTable.jobs[i];
+      if (job->id != 0 && jobState(job) != Stopped) {
+        jobWait(job);
+        status = jobStatus(job);
+        if (jobState(job) == Done) {
+          jobDone(job);
         }
-      } 
-      err = close(fd[1]);
-      terminateIfError("file", err);
-      err = waitpid(pid, &status, 0);
-      terminateIfError("waitpid", err);
-      int filedes = open(cmds[i + 2].command, O_RDWR | O_CREAT | O_APPEND, 
-              S_IWUSR | S_IRUSR);
-      terminateIfError("file", filedes);
-      size_t size;
-      char buf[1024];
-      while((size=read(fd[0], buf, 1024)) > 0) {
-        err = write(filedes, buf, size);
-        terminateIfError("write", err);
       }
-      err = close(filedes);
-      terminateIfError("file", err);
-      i += 2;
-    } else if (i + 2 < n && strcmp(cmds[i+1].command, ">") == 0) {
-      int fd[2];
-      err = pipe(fd);
-      terminateIfError("pipe", err);
-      pid_t pid = fork();
-      if (pid == 0) {
-        if (i > 1 && strcmp(cmds[i-1].command, "|") == 0) {
-          dup2(in, STDIN_FILENO);
-        }
-        dup2(fd[1], STDOUT_FILENO);
-        err = execvp(cmds[i].command, cmds[i].argv);
-        if (err == -1) {
-          exit(EXIT_FAILURE);
-        }
-      } 
-      err = close(fd[1]);
-      terminateIfError("file", err);
-      err = waitpid(pid, &status, 0);
-      terminateIfError("watipid", err);
-      int filedes = open(cmds[i + 2].command, O_RDWR | O_CREAT | O_TRUNC, 
-              S_IWUSR | S_IRUSR);
-      terminateIfError("file", filedes);
-      size_t size;
-      char buf[1024];
-      while((size=read(fd[0], buf, 1024)) > 0) {
-        err = write(filedes, buf, size);
-        terminateIfError("write", err);
+    }
+    return exitStatus(status);
+  }
+  for (size_t i = 1; i < cmd->argc; ++i) {
+    Job* job = jobFind(cmd->argv[i]);
+    if (job == NULL) {
+      fprintf(stderr, "wait: %s: no such job\n", cmd->argv[i]);
+      status = W_EXITCODE(127, 0);
+      continue;
+    }
+    jobWait(job);
+    status = jobStatus(job);
+    if (jobState(job) == Done) {
+      jobDone(job);
+    }
+  }
+  return exitStatus(status);
+}
+
+int builtinFg(Cmd* cmd) {
+  Job* job = jobFind(cmd->argv[1]);
+  if (job == NULL) {
+    fprintf(stderr, "fg: no such job\n");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "%s\n", job->cmdline);
+  jobContinue(job, false);
+  jobWait(job);
+  int status = jobStatus(job);
+  if (jobState(job) == Done) {
+    jobDone(job);
+  }
+  return exitStatus(status);
+}
+
+int builtinBg(Cmd* cmd) {
+  Job* job = jobFind(cmd->argv[1]);
+  if (job == NULL) {
+    fprintf(stderr, "bg: no such job\n");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "[%d] %s &\n", job->id, job->cmdline);
+  jobContinue(job, true);
+  return 0;
+}
+
+// Signals kill accepts by name, with or without the SIG prefix.
+static const struct {
+  const char* name;
+  int sig;
+} signalNames[] = {
+  {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+  {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+  {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+  {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+
+// Returns the signal named by name, a number or a name, or -1.
+int parseSignal(const char* name) {
+  if (*name >= '0' && *name <= '9') {
+    return atoi(name);
+  }
+  if (strncmp(name, "SIG", 3) == 0) {
+    name += 3;
+  }
+  for (size_t i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]); ++i) {
+    if (strcmp(signalNames[i].name, name) == 0) {
+      return signalNames[i].sig;
+    }
+  }
+  return -1;
+}
+
+// kill [-SIG] pid|%job...
+// Sends SIGTERM or the given signal. A job spec signals the process group of
+// the job or, without one, each of its processes still running.
+int builtinKill(Cmd* cmd) {
+  size_t first = 1;
+  int sig = SIGTERM;
+  if (cmd->argc > first && cmd->argv[first][0] == '-') {
+    sig = parseSignal(cmd->argv[first++] + 1);
+  }
+  if (sig < 0 || first == cmd->argc) {
+    fprintf(stderr, "usage: kill [-SIG] pid|%%job...\n");
+    return 2;
+  }
+  int status = 0;
+  for (size_t i = first; i < cmd->argc; ++i) {
+    const char* spec = cmd->argv[i];
+    if (spec[0] != '%') {
+      if (kill(atoi(spec), sig) == -1) {
+        fprintf(stderr, "kill: %s: %s\n", spec, strerror(errno));
+        status = EXIT_FAILURE;
       }
-      err = close(filedes);
-      terminateIfError("file", err);
-      i += 2;
-    } else if (strcmp(cmds[i].command, "&&") == 0 || 
-        strcmp(cmds[i].command, "||") == 0) {
       continue;
+    }
+    Job* job = jobFind(spec);
+    if (job == NULL) {
+      fprintf(stderr, "kill: %s: no such job\n", spec);
+      status = EXIT_FAILURE;
+    } else if (job->pgid > 0) {
+      kill(-job->pgid, sig);
     } else {
-      pid_t pid = fork();
-      if (pid == 0) {
-        if (i > 1 && strcmp(cmds[i-1].command, "|") == 0) {
-          dup2(in, STDIN_FILENO);
+      for (size_t j = 0; j < job->count; ++j) {
+        if (job->procs[j].running) {
+          kill(job->procs[j].pid, sig);
         }
-        if (execvp(cmds[i].command, cmds[i].argv) == -1) {
-          cmdFree(cmds, n);
-          exit(EXIT_FAILURE);
-        }; 
       }
-      err = waitpid(pid, &status, 0);
-      terminateIfError("waitpid", err);
     }
   }
-  if (in != STDIN_FILENO) {
-    err = close(in);
-    terminateIfError("file", err);
+  return status;
+}
+
+// ParallelItems yields the items of a parallel run: the words after ::: or,
+// without them, the non-empty lines of the standard input.
+typedef struct ParallelItems {
+  char** words;
+  size_t count;
+  Reader* stdinReader;
+  char* line;
+} ParallelItems;
+
+// Returns the next item, valid until the next call, or NULL when there is none.
+const char* parallelNext(ParallelItems* items) {
+  if (items->stdinReader == NULL) {
+    if (items->count == 0) {
+      return NULL;
+    }
+    --items->count;
+    return *items->words++;
+  }
+  free(items->line);
+  items->line = NULL;
+  const char* line = NULL;
+  ssize_t len;
+  while ((len = readerLine(items->stdinReader, &line)) != -1) {
+    if (line[len - 1] == '\n') {
+      --len;
+    }
+    if (len > 0) {
+      items->line = strndup(line, len);
+      return items->line;
+    }
+  }
+  return NULL;
+}
+
+// parallel [-j N] command [arg...] [::: item...]
+// Runs command once per item, with the item in place of every {} argument or
+// appended when there is none. At most N commands run at a time, the number of
+// online CPUs by default. Items come from the arguments after ::: or from the
+// lines of the standard input, which the commands then do not inherit. All
+// commands are processes of one job, reaped as they finish. The status is the
+// number of failed commands, at most 101.
+int builtinParallel(Cmd* cmd) {
+  long slots = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t first = 1;
+  if (cmd->argc > first && strncmp(cmd->argv[first], "-j", 2) == 0) {
+    const char* value = cmd->argv[first][2] != '\0' ? cmd->argv[first] + 2 : cmd->argv[++first];
+    slots = value == NULL ? 0 : atol(value);
+    ++first;
+  }
+  size_t sep = first;
+  while (sep < cmd->argc && strcmp(cmd->argv[sep], ":::") != 0) {
+    ++sep;
+  }
+  if (slots < 1 || sep == first) {
+    fprintf(stderr, "usage: parallel [-j N] command [arg...] [::: item...]\n");
+    return 2;
+  }
+
+  Reader stdinReader;
+  ParallelItems items = {NULL, 0, NULL, NULL};
+  int devNull = -1;
+  if (sep < cmd->argc) {
+    items.words = cmd->argv + sep + 1;
+    items.count = cmd->argc - sep - 1;
+  } else {
+    devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devNull == -1 || readerOpen(&stdinReader, STDIN_FILENO) == -1) {
+      perror("parallel");
+      return EXIT_FAILURE;
+    }
+    items.stdinReader = &stdinReader;
+  }
+  size_t argCount = sep - first;
+  bool placeholder = false;
+  for (size_t i = first; i < sep; ++i) {
+    placeholder = placeholder || strcmp(cmd->argv[i], "{}") == 0;
+  }
+  char** argv = malloc((argCount + 2) * sizeof(char*));
+  if (argv == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // Children stay in the process group of the shell, a group led by
+  // a short-lived child could vanish before the last one is started.
+  Job* job = jobNew(cmdText(cmd, 1), false);
+  job->pgid = -1;
+  FdAction action = {devNull, STDIN_FILENO};
+  SpawnOpts opts = {&action, devNull == -1 ? 0 : 1, -1, -1};
+  const char* item;
+  while ((item = parallelNext(&items)) != NULL) {
+    while (job->alive >= (size_t)slots && jobsReapOne(true)) {}
+    for (size_t i = 0; i < argCount; ++i) {
+      const char* word = cmd->argv[first + i];
+      argv[i] = placeholder && strcmp(word, "{}") == 0 ? (char*)item : (char*)word;
+    }
+    argv[argCount] = placeholder ? NULL : (char*)item;
+    argv[argCount + 1] = NULL;
+    pid_t pid = -1;
+    uint64_t start = nowUsec();
+    int err = spawnCmd(argv, &opts, &pid);
+    uint64_t spawned = nowUsec();
+    int status = 0;
+    if (err == ENOENT) {
+      status = W_EXITCODE(127, 0);
+    } else if (err != 0) {
+      fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+      status = W_EXITCODE(126, 0);
+    }
+    Proc* proc = jobAddProcess(job, argv[0], err == 0 ? pid : -1, status);
+    proc->startUsec = start;
+    proc->spawnUsec = spawned - start;
+  }
+  while (job->alive > 0 && jobsReapOne(true)) {}
+
+  size_t failed = 0;
+  for (size_t i = 0; i < job->count; ++i) {
+    failed += job->procs[i].status != 0;
+  }
+  if (failed > 0) {
+    fprintf(stderr, "parallel: %zu of %zu commands failed\n", failed, job->count);
+  }
+  jobDone(job);
+  free(argv);
+  if (items.stdinReader != NULL) {
+    free(items.line);
+    readerClose(&stdinReader);
+    close(devNull);
+  }
+  return failed > 101 ? 101 : (int)failed;
+}
+
+typedef int (*builtinFunc)(Cmd* cmd);
+
+typedef struct Builtin {
+  const char* name;
+  builtinFunc run;
+} Builtin;
+
+static const Builtin builtins[] = {
+  {"cd", builtinCd},
+  {"exit", builtinExit},
+  {"hash", builtinHash},
+  {"jobs", builtinJobs},
+  {"wait", builtinWait},
+  {"fg", builtinFg},
+  {"bg", builtinBg},
+  {"kill", builtinKill},
+  {"parallel", builtinParallel},
+};
+
+const Builtin* findBuiltin(const char* name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+    if (strcmp(builtins[i].name, name) == 0) {
+      return &builtins[i];
+    }
+  }
+  return NULL;
+}
+
+// Runs a builtin as a stage of a pipeline in a forked copy of the shell.
+int forkBuiltin(const Builtin* builtin, Cmd* cmd, const SpawnOpts* opts, pid_t* pid) {
+  fflush(stdout);
+  *pid = fork();
+  if (*pid == -1) {
+    return errno;
+  }
+  if (*pid == 0) {
+    if (opts->pgid != -1) {
+      setpgid(0, opts->pgid);
+    }
+    jobsReset();
+    for (size_t i = 0; i < opts->actionCount; ++i) {
+      const FdAction* a = &opts->actions[i];
+      if (a->src == -1) {
+        close(a->fd);
+      } else if (dup2(a->src, a->fd) == -1) {
+        perror("dup2");
+        _exit(EXIT_FAILURE);
+      }
+    }
+    int status = builtin->run(cmd);
+    fflush(stdout);
+    _exit(status);
+  }
+  if (opts->pgid != -1) {
+    setpgid(*pid, opts->pgid == 0 ? *pid : opts->pgid);
+  }
+  return 0;
+}
+
+// Starts the pipeline cmds[0..n) as processes of job. Stages are separated
+// by "|". Pipe ends and redirections are installed by dup2 in the child right
+// before exec, the shell only opens the files. All stages run at the same
+// time, so a stage never waits for a full pipe to be drained.
+void launchPipeline(Job* job, Cmd* cmds, size_t n) {
+  int in = STDIN_FILENO;
+  size_t i = 0;
+  while (i < n) {
+    Cmd* stage = &cmds[i++];
+    int out = STDOUT_FILENO;
+    int next = STDIN_FILENO;
+    int fd[2] = {-1, -1};
+    if (i < n && isOp(&cmds[i], "|")) {
+      terminateIfError("pipe", pipe2(fd, O_CLOEXEC));
+      out = fd[1];
+      next = fd[0];
+      ++i;
+    }
+
+    FdAction* actions = malloc((stage->redirCount + 2) * sizeof(FdAction));
+    RedirFile* files = malloc((stage->redirCount + 1) * sizeof(RedirFile));
+    if (actions == NULL || files == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    size_t actionCount = 0;
+    if (in != STDIN_FILENO) {
+      actions[actionCount++] = (FdAction){in, STDIN_FILENO};
+    }
+    if (out != STDOUT_FILENO) {
+      actions[actionCount++] = (FdAction){out, STDOUT_FILENO};
+    }
+    uint64_t start = nowUsec();
+    Cmd cmd;
+    expandCmd(stage, &cmd);
+    ssize_t fileCount = openRedirects(&cmd, actions, &actionCount, files);
+
+    bool leader = job->pgid == 0;
+    SpawnOpts opts = {actions, actionCount, job->pgid, -1};
+    if (leader && jobTable.jobControl && !job->background) {
+      opts.tty = STDIN_FILENO;
+    }
+    const Builtin* builtin = stage->argc == 0 ? NULL : findBuiltin(cmd.command);
+    pid_t pid = -1;
+    int err = 0;
+    int status = 0;
+    if (fileCount == -1) {
+      status = W_EXITCODE(1, 0);
+    } else if (stage->argc > 0) {
+      err = builtin != NULL ? forkBuiltin(builtin, &cmd, &opts, &pid)
+                            : spawnCmd(cmd.argv, &opts, &pid);
+    }
+    uint64_t spawned = nowUsec();
+    if (err == ENOENT) {
+      status = W_EXITCODE(127, 0);
+    } else if (err != 0) {
+      fprintf(stderr, "%s: %s\n", cmd.command, strerror(err));
+      status = W_EXITCODE(126, 0);
+    }
+    Proc* proc = jobAddProcess(job, cmd.command, pid != -1 && err == 0 ? pid : -1, status);
+    proc->startUsec = start;
+    proc->spawnUsec = spawned - start;
+    if (fileCount > 0 && traceFd != -1) {
+      // The trace reads the final offsets of the files when the job is done.
+      proc->redirs = files;
+      proc->redirCount = fileCount;
+    } else {
+      closeRedirects(files, fileCount == -1 ? 0 : fileCount);
+      free(files);
+    }
+    free(actions);
+    expandFree(stage, &cmd);
+
+    if (in != STDIN_FILENO) {
+      terminateIfError("file", close(in));
+    }
+    if (fd[1] != -1) {
+      terminateIfError("file", close(fd[1]));
+    }
+    in = next;
+  }
+}
+
+// Runs a single builtin, or a command made of redirections only, in the shell
+// itself. Redirections apply for the time of the builtin. Returns its exit
+// status.
+int runInShell(const Builtin* builtin, Cmd* cmds) {
+  FdAction* actions = malloc((cmds->redirCount + 1) * sizeof(FdAction));
+  RedirFile* files = malloc((cmds->redirCount + 1) * sizeof(RedirFile));
+  int* saved = malloc((cmds->redirCount + 1) * sizeof(int));
+  if (actions == NULL || files == NULL || saved == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t actionCount = 0;
+  uint64_t start = nowUsec();
+  Cmd cmd;
+  expandCmd(cmds, &cmd);
+  ssize_t fileCount = openRedirects(&cmd, actions, &actionCount, files);
+  int status = EXIT_FAILURE;
+  if (fileCount != -1) {
+    status = 0;
+    if (builtin != NULL) {
+      applyFds(actions, actionCount, saved);
+      status = builtin->run(&cmd);
+      restoreFds(actions, actionCount, saved);
+    }
+    closeRedirects(files, fileCount);
+  }
+  expandFree(cmds, &cmd);
+  if (traceFd != -1) {
+    traceBuiltin(cmds->command, start, status);
+  }
+  free(saved);
+  free(files);
+  free(actions);
+  return status;
+}
+
+// Runs the pipeline cmds[0..n) and returns its exit status. A single builtin
+// runs in the shell itself. A foreground pipeline is waited for, a background
+// one is left in the job table and its status is 0.
+int runPipeline(Cmd* cmds, size_t n, bool background) {
+  if (n == 1 && !background) {
+    const Builtin* builtin = findBuiltin(cmds->command);
+    if (builtin != NULL || cmds->argc == 0) {
+      return runInShell(builtin, cmds);
+    }
+  }
+  Job* job = jobNew(cmdText(cmds, n), background);
+  launchPipeline(job, cmds, n);
+  if (background) {
+    if (jobTable.jobControl) {
+      fprintf(stderr, "[%d] %d\n", job->id, job->pgid);
+    }
+    return 0;
   }
-  while (waitpid(-1, &status, WNOHANG) > 0) {}
+  jobWait(job);
+  int status = jobStatus(job);
+  if (jobState(job) == Done) {
+    jobDone(job);
+  }
+  return exitStatus(status);
 }
 
-int main() {
+// Runs pipelines joined by && and ||. The operators have equal precedence
+// and are applied left to right: a pipeline runs only if the status of the
+// last executed one allows it, a skipped pipeline costs nothing and keeps
+// the status. Returns the status of the last executed pipeline.
+int runAndOr(Cmd* cmds, size_t n) {
+  size_t i = 0;
+  bool run = true;
+  while (i < n) {
+    size_t end = i;
+    while (end < n && !isOp(&cmds[end], "&&") && !isOp(&cmds[end], "||")) {
+      ++end;
+    }
+    if (run && end > i) {
+      lastStatus = runPipeline(cmds + i, end - i, false);
+    }
+    if (end < n) {
+      run = isOp(&cmds[end], "&&") ? lastStatus == 0 : lastStatus != 0;
+    }
+    i = end + 1;
+  }
+  return lastStatus;
+}
+
+// Runs an && / || list in background. Unlike a single pipeline, it needs
+// a decision after every step, so it is evaluated by a forked copy of the shell
+// in its own process group.
+void runBackgroundList(Cmd* cmds, size_t n) {
+  Job* job = jobNew(cmdText(cmds, n), true);
+  fflush(stdout);
+  pid_t pid = fork();
+  terminateIfError("fork", pid);
+  if (pid == 0) {
+    setpgid(0, 0);
+    jobsReset();
+    exit(runAndOr(cmds, n));
+  }
+  setpgid(pid, pid);
+  Proc* proc = jobAddProcess(job, "sh", pid, 0);
+  proc->startUsec = job->startUsec;
+  if (jobTable.jobControl) {
+    fprintf(stderr, "[%d] %d\n", job->id, pid);
+  }
+}
+
+// Runs a command line: && / || lists separated by ; or &. A list followed
+// by & runs in background, which sets $? to 0.
+void runCmd(Cmd* cmds, ssize_t n) {
+  size_t i = 0;
+  size_t count = n < 0 ? 0 : n;
+  while (i < count) {
+    size_t end = i;
+    bool andOr = false;
+    while (end < count && !isOp(&cmds[end], ";") && !isOp(&cmds[end], "&")) {
+      andOr = andOr || isOp(&cmds[end], "&&") || isOp(&cmds[end], "||");
+      ++end;
+    }
+    if (end == i) {
+      ++i;
+      continue;
+    }
+    if (end == count || isOp(&cmds[end], ";")) {
+      runAndOr(cmds + i, end - i);
+    } else if (andOr) {
+      runBackgroundList(cmds + i, end - i);
+      lastStatus = 0;
+    } else {
+      lastStatus = runPipeline(cmds + i, end - i, true);
+    }
+    i = end + 1;
+  }
+}
+
+// Runs commands from the script file given as the first argument, from the
+// string given with -c, or from the standard input. With -T fd every finished
+// command is traced into fd as a JSON line.
+int main(int argc, char** argv) {
+  int arg = 1;
+  if (argc > arg + 1 && strcmp(argv[arg], "-T") == 0) {
+    if (traceInit(atoi(argv[arg + 1])) == -1) {
+      perror("-T");
+      return 2;
+    }
+    arg += 2;
+  }
+  Reader reader;
+  bool interactive = false;
+  if (argc > arg + 1 && strcmp(argv[arg], "-c") == 0) {
+    readerOpenString(&reader, argv[arg + 1]);
+  } else if (argc > arg) {
+    int fd = open(argv[arg], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(argv[arg]);
+      return 127;
+    }
+    if (readerOpen(&reader, fd) == -1) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+  } else {
+    if (readerOpen(&reader, STDIN_FILENO) == -1) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+    interactive = isatty(STDIN_FILENO);
+  }
+  jobsInit(interactive);
   while(true) { 
+    jobsPoll();
     Cmd* cmds = NULL;
-    ssize_t n = getCmds(&cmds, stdin);
+    ssize_t n = getCmds(&cmds, &reader);
     if (n == -1) {
-      return 0;
+      break;
     }
+    if (n == -2) {
+      lastStatus = 2;
+      continue;
+    }
+    readerSync(&reader);
     runCmd(cmds, n);
+    readerResume(&reader);
     cmdFree(cmds, n);
   }
-  return 0;
+  readerClose(&reader);
+  return lastStatus;
 }
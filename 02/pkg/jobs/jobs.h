@@ -0,0 +1,392 @@
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "../launcher/launcher.h"
+
+typedef enum JobState{Running, Stopped, Done} JobState;
+
+// RedirFile is a file opened for a redirection of a process. It is kept open
+// to count the bytes moved through it from the offset it had at start.
+typedef struct RedirFile {
+  int fd;
+  off_t start;
+} RedirFile;
+
+// Proc is a process of a job.
+typedef struct Proc {
+  // -1 if the process could not be started.
+  pid_t pid;
+  bool running;
+  // Whether the last status reported for the process was a stop.
+  bool stopped;
+  // Wait status and resource usage, valid once the process is reaped.
+  int status;
+  struct rusage usage;
+  char* name;
+  // Monotonic times in microseconds: when spawning started, how long it
+  // took and when the process was reaped.
+  uint64_t startUsec;
+  uint64_t spawnUsec;
+  uint64_t endUsec;
+  // Files opened for the redirections of the process, kept while tracing.
+  RedirFile* redirs;
+  size_t redirCount;
+} Proc;
+
+// Job is a pipeline started by the shell. All its processes share one process
+// group when the job is in background or job control is enabled.
+typedef struct Job {
+  // Job number as shown by the jobs builtin. 0 marks a free slot.
+  int id;
+  pid_t pgid;
+  Proc* procs;
+  size_t count;
+  size_t cap;
+  // Processes which are not reaped yet and how many of them are stopped.
+  size_t alive;
+  size_t stopped;
+  bool background;
+  char* cmdline;
+  uint64_t startUsec;
+} Job;
+
+// JobTable holds all unfinished jobs of the shell. Children are reaped only
+// through it, so a pid is never waited for twice.
+typedef struct JobTable {
+  Job* jobs;
+  size_t cap;
+  // Both ends of the self-pipe the SIGCHLD handler writes to.
+  int sigPipe[2];
+  // Whether the shell owns a terminal and moves jobs between foreground and background.
+  bool jobControl;
+  pid_t shellPgid;
+  // Called for every finished job before it is dropped from the table.
+  void (*onDone)(const Job* job);
+} JobTable;
+
+static JobTable jobTable = {NULL, 0, {-1, -1}, false, 0, NULL};
+
+// Set by the SIGCHLD handler, lets jobsPoll skip the self-pipe read between
+// signals. Matters in script mode, where it is called for every line.
+static volatile sig_atomic_t sigchldPending = 0;
+
+void onSigchld(int sig) {
+  int savedErrno = errno;
+  sigchldPending = 1;
+  char c = 0;
+  ssize_t rc = write(jobTable.sigPipe[1], &c, 1);
+  (void)rc;
+  errno = savedErrno;
+}
+
+// Creates the self-pipe and installs the SIGCHLD handler. A write into a full
+// pipe is simply dropped: one pending byte is enough to trigger reaping.
+void jobsOpenSigPipe() {
+  if (pipe2(jobTable.sigPipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onSigchld;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+}
+
+// Prepares the job table. Job control is turned on for an interactive shell,
+// which reads commands from a terminal: the shell takes the terminal for its
+// own process group and ignores the signals sent by the terminal driver.
+void jobsInit(bool interactive) {
+  jobsOpenSigPipe();
+  jobTable.jobControl = interactive;
+  if (!jobTable.jobControl) {
+    return;
+  }
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+  setpgid(0, 0);
+  jobTable.shellPgid = getpgrp();
+  tcsetpgrp(STDIN_FILENO, jobTable.shellPgid);
+}
+
+void jobFree(Job* job) {
+  for (size_t i = 0; i < job->count; ++i) {
+    free(job->procs[i].name);
+    for (size_t j = 0; j < job->procs[i].redirCount; ++j) {
+      close(job->procs[i].redirs[j].fd);
+    }
+    free(job->procs[i].redirs);
+  }
+  free(job->procs);
+  free(job->cmdline);
+  memset(job, 0, sizeof(Job));
+}
+
+// Drops a finished job from the table.
+void jobDone(Job* job) {
+  if (jobTable.onDone != NULL) {
+    jobTable.onDone(job);
+  }
+  jobFree(job);
+}
+
+// Forgets all jobs without waiting for them. Used in a forked subshell, which
+// must not reap the children of its parent.
+void jobsReset() {
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    if (jobTable.jobs[i].id != 0) {
+      jobFree(&jobTable.jobs[i]);
+    }
+  }
+  close(jobTable.sigPipe[0]);
+  close(jobTable.sigPipe[1]);
+  jobsOpenSigPipe();
+  jobTable.jobControl = false;
+}
+
+// Takes cmdline, which must be allocated with malloc, and returns a new job
+// without processes. Job numbers continue after the biggest one in use.
+Job* jobNew(char* cmdline, bool background) {
+  int id = 1;
+  Job* slot = NULL;
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    Job* job = &jobTable.jobs[i];
+    if (job->id == 0) {
+      slot = slot == NULL ? job : slot;
+    } else if (job->id >= id) {
+      id = job->id + 1;
+    }
+  }
+  if (slot == NULL) {
+    size_t newCap = (jobTable.cap + 1) * 2;
+    Job* np = realloc(jobTable.jobs, newCap * sizeof(Job));
+    if (np == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    memset(np + jobTable.cap, 0, (newCap - jobTable.cap) * sizeof(Job));
+    slot = np + jobTable.cap;
+    jobTable.jobs = np;
+    jobTable.cap = newCap;
+  }
+  slot->id = id;
+  slot->pgid = background || jobTable.jobControl ? 0 : -1;
+  slot->background = background;
+  slot->cmdline = cmdline;
+  slot->startUsec = nowUsec();
+  return slot;
+}
+
+// Adds a process named name to the job and returns it for the caller to
+// fill in timings. A process that could not be started is added with pid -1
+// and its final wait status.
+Proc* jobAddProcess(Job* job, const char* name, pid_t pid, int status) {
+  if (job->count + 1 > job->cap) {
+    size_t newCap = (job->cap + 1) * 2;
+    Proc* procs = realloc(job->procs, newCap * sizeof(Proc));
+    if (procs == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    job->procs = procs;
+    job->cap = newCap;
+  }
+  Proc* proc = &job->procs[job->count++];
+  memset(proc, 0, sizeof(Proc));
+  proc->pid = pid;
+  proc->running = pid != -1;
+  proc->status = status;
+  proc->name = strdup(name);
+  if (pid != -1) {
+    ++job->alive;
+    if (job->pgid == 0) {
+      job->pgid = pid;
+    }
+  }
+  return proc;
+}
+
+JobState jobState(const Job* job) {
+  if (job->alive == 0) {
+    return Done;
+  }
+  return job->alive == job->stopped ? Stopped : Running;
+}
+
+// Converts a wait status into an exit status the way it is shown in $?.
+int exitStatus(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+// Status of a job is the status of its last process, as in a pipeline.
+int jobStatus(const Job* job) {
+  return job->count == 0 ? 0 : job->procs[job->count - 1].status;
+}
+
+// Records a status reported by wait4 in the job owning pid. A stopped process
+// is counted in job->stopped until it is continued or exits.
+void jobsUpdate(pid_t pid, int status, const struct rusage* usage) {
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    Job* job = &jobTable.jobs[i];
+    for (size_t j = 0; job->id != 0 && j < job->count; ++j) {
+      Proc* proc = &job->procs[j];
+      if (proc->pid != pid || !proc->running) {
+        continue;
+      }
+      if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+        if (proc->stopped != (bool)WIFSTOPPED(status)) {
+          proc->stopped = WIFSTOPPED(status);
+          job->stopped += proc->stopped ? 1 : -1;
+        }
+        return;
+      }
+      if (proc->stopped) {
+        proc->stopped = false;
+        --job->stopped;
+      }
+      proc->status = status;
+      proc->usage = *usage;
+      proc->endUsec = nowUsec();
+      proc->running = false;
+      --job->alive;
+      return;
+    }
+  }
+}
+
+// Reaps one child. Returns false if there was nothing to reap.
+bool jobsReapOne(bool block) {
+  int status;
+  struct rusage usage;
+  int options = WUNTRACED | WCONTINUED | (block ? 0 : WNOHANG);
+  pid_t pid = wait4(-1, &status, options, &usage);
+  while (pid == -1 && errno == EINTR) {
+    pid = wait4(-1, &status, options, &usage);
+  }
+  if (pid <= 0) {
+    return false;
+  }
+  jobsUpdate(pid, status, &usage);
+  return true;
+}
+
+void jobPrint(const Job* job, FILE* stream) {
+  static const char* names[] = {"Running", "Stopped", "Done"};
+  fprintf(stream, "[%d]  %-22s %s\n", job->id, names[jobState(job)], job->cmdline);
+}
+
+// Reaps the children SIGCHLD was delivered for since the last call and drops
+// finished background jobs. With job control they are reported as done.
+// Costs nothing when no signal came.
+void jobsPoll() {
+  if (!sigchldPending) {
+    return;
+  }
+  sigchldPending = 0;
+  char buf[64];
+  bool signaled = false;
+  while (read(jobTable.sigPipe[0], buf, sizeof(buf)) > 0) {
+    signaled = true;
+  }
+  if (!signaled) {
+    return;
+  }
+  while (jobsReapOne(false)) {}
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    Job* job = &jobTable.jobs[i];
+    if (job->id != 0 && job->background && jobState(job) == Done) {
+      if (jobTable.jobControl) {
+        jobPrint(job, stderr);
+      }
+      jobDone(job);
+    }
+  }
+}
+
+// Waits until every process of the job exits or stops. With job control the
+// terminal is handed to the job for the time of waiting.
+void jobWait(Job* job) {
+  if (jobTable.jobControl && job->pgid > 0) {
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  }
+  while (job->alive > job->stopped && jobsReapOne(true)) {}
+  if (jobTable.jobControl && job->pgid > 0) {
+    tcsetpgrp(STDIN_FILENO, jobTable.shellPgid);
+  }
+  if (jobState(job) == Stopped) {
+    job->background = true;
+    if (jobTable.jobControl) {
+      fprintf(stderr, "\n");
+      jobPrint(job, stderr);
+    }
+  }
+}
+
+// Resumes a stopped job in the foreground or in the background.
+void jobContinue(Job* job, bool background) {
+  job->background = background;
+  if (job->stopped == 0) {
+    return;
+  }
+  job->stopped = 0;
+  for (size_t i = 0; i < job->count; ++i) {
+    job->procs[i].stopped = false;
+  }
+  if (job->pgid > 0) {
+    kill(-job->pgid, SIGCONT);
+    return;
+  }
+  for (size_t i = 0; i < job->count; ++i) {
+    if (job->procs[i].running) {
+      kill(job->procs[i].pid, SIGCONT);
+    }
+  }
+}
+
+// Finds a job by a job spec: %n, %% or %+ for the latest job, or a pid of one
+// of its processes. A NULL spec means the latest job.
+Job* jobFind(const char* spec) {
+  Job* latest = NULL;
+  for (size_t i = 0; i < jobTable.cap; ++i) {
+    Job* job = &jobTable.jobs[i];
+    if (job->id == 0) {
+      continue;
+    }
+    if (latest == NULL || job->id > latest->id) {
+      latest = job;
+    }
+    if (spec == NULL || spec[0] != '%') {
+      for (size_t j = 0; spec != NULL && j < job->count; ++j) {
+        if (job->procs[j].pid == atoi(spec)) {
+          return job;
+        }
+      }
+    } else if (atoi(spec + 1) == job->id) {
+      return job;
+    }
+  }
+  if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 ||
+      strcmp(spec, "%") == 0) {
+    return latest;
+  }
+  return NULL;
+}
@@ -0,0 +1,325 @@
+#pragma once
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// PathEntry is a slot of the command path cache. A slot with name == NULL is free.
+typedef struct PathEntry {
+  char* name;
+  char* path;
+  uint64_t hash;
+  size_t hits;
+  // Sum of posix_spawn latencies of the command in microseconds.
+  uint64_t spawnUsec;
+} PathEntry;
+
+// PathCache remembers where commands were found on PATH, like the bash hash builtin.
+// It is an open addressing table with linear probing, its capacity is a power of two.
+typedef struct PathCache {
+  PathEntry* entries;
+  size_t cap;
+  size_t count;
+  // Copy of PATH the cache was filled with. The cache is dropped when PATH changes.
+  char* pathEnv;
+} PathCache;
+
+static PathCache pathCache = {NULL, 0, 0, NULL};
+
+uint64_t hashString(const char* s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s != '\0'; ++s) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void pathCacheClear() {
+  for (size_t i = 0; i < pathCache.cap; ++i) {
+    free(pathCache.entries[i].name);
+    free(pathCache.entries[i].path);
+  }
+  free(pathCache.entries);
+  pathCache.entries = NULL;
+  pathCache.cap = 0;
+  pathCache.count = 0;
+}
+
+// Drops the cache if PATH differs from the one it was filled with.
+void pathCacheSync() {
+  const char* env = getenv("PATH");
+  if (env == NULL) {
+    env = "";
+  }
+  if (pathCache.pathEnv != NULL && strcmp(pathCache.pathEnv, env) == 0) {
+    return;
+  }
+  pathCacheClear();
+  free(pathCache.pathEnv);
+  pathCache.pathEnv = strdup(env);
+}
+
+PathEntry* pathCacheSlot(PathEntry* entries, size_t cap, const char* name, uint64_t hash) {
+  size_t i = hash & (cap - 1);
+  while (entries[i].name != NULL) {
+    if (entries[i].hash == hash && strcmp(entries[i].name, name) == 0) {
+      break;
+    }
+    i = (i + 1) & (cap - 1);
+  }
+  return &entries[i];
+}
+
+ssize_t pathCacheGrow() {
+  size_t newCap = pathCache.cap == 0 ? 64 : pathCache.cap * 2;
+  PathEntry* np = calloc(newCap, sizeof(PathEntry));
+  if (np == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < pathCache.cap; ++i) {
+    PathEntry* e = &pathCache.entries[i];
+    if (e->name != NULL) {
+      *pathCacheSlot(np, newCap, e->name, e->hash) = *e;
+    }
+  }
+  free(pathCache.entries);
+  pathCache.entries = np;
+  pathCache.cap = newCap;
+  return 0;
+}
+
+// Drops the entry e from the cache. The entries after it in its probe run are
+// moved back, so the table needs no tombstones.
+void pathCacheRemove(PathEntry* e) {
+  size_t mask = pathCache.cap - 1;
+  size_t slot = e - pathCache.entries;
+  free(e->name);
+  free(e->path);
+  memset(e, 0, sizeof(PathEntry));
+  --pathCache.count;
+  for (size_t i = (slot + 1) & mask; pathCache.entries[i].name != NULL; i = (i + 1) & mask) {
+    size_t home = pathCache.entries[i].hash & mask;
+    // Entry i may move to slot if its home is not in (slot, i].
+    if (((i - home) & mask) >= ((i - slot) & mask)) {
+      pathCache.entries[slot] = pathCache.entries[i];
+      memset(&pathCache.entries[i], 0, sizeof(PathEntry));
+      slot = i;
+    }
+  }
+}
+
+// Walks PATH the way execvp does and returns the first executable regular file
+// named name. The returned string must be freed. Returns NULL if nothing is found.
+char* searchPath(const char* name) {
+  const char* dir = pathCache.pathEnv;
+  size_t nameLen = strlen(name);
+  while (dir != NULL) {
+    const char* end = strchr(dir, ':');
+    size_t dirLen = end == NULL ? strlen(dir) : (size_t)(end - dir);
+    char* path = malloc(dirLen + nameLen + 3);
+    if (path == NULL) {
+      return NULL;
+    }
+    if (dirLen == 0) {
+      // An empty PATH element stands for the current directory.
+      memcpy(path, ".", 1);
+      dirLen = 1;
+    } else {
+      memcpy(path, dir, dirLen);
+    }
+    path[dirLen] = '/';
+    memcpy(path + dirLen + 1, name, nameLen + 1);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+      return path;
+    }
+    free(path);
+    dir = end == NULL ? NULL : end + 1;
+  }
+  return NULL;
+}
+
+// Resolves a command name to the path of its executable through the cache.
+// Names containing a slash are used as is. Misses are not cached, so a command
+// installed later is found on the next lookup.
+PathEntry* lookupCmd(const char* name) {
+  pathCacheSync();
+  if (pathCache.count + 1 > pathCache.cap / 2 && pathCacheGrow() == -1) {
+    return NULL;
+  }
+  uint64_t hash = hashString(name);
+  PathEntry* e = pathCacheSlot(pathCache.entries, pathCache.cap, name, hash);
+  if (e->name != NULL) {
+    return e;
+  }
+  char* path = searchPath(name);
+  if (path == NULL) {
+    return NULL;
+  }
+  e->name = strdup(name);
+  if (e->name == NULL) {
+    free(path);
+    return NULL;
+  }
+  e->path = path;
+  e->hash = hash;
+  e->hits = 0;
+  e->spawnUsec = 0;
+  ++pathCache.count;
+  return e;
+}
+
+uint64_t nowUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FdAction makes descriptor fd of the child a copy of src, or closes fd when
+// src is -1.
+typedef struct FdAction {
+  int src;
+  int fd;
+} FdAction;
+
+// SpawnOpts describes the environment a command is started in.
+typedef struct SpawnOpts {
+  // Descriptor changes applied in order in the child: pipe ends first, then
+  // redirections, so that 2>&1 sees where stdout goes.
+  const FdAction* actions;
+  size_t actionCount;
+  // Process group to put the child into: -1 keeps the group of the shell,
+  // 0 starts a new group led by the child.
+  pid_t pgid;
+  // Terminal to make the child's process group the foreground one, or -1.
+  int tty;
+} SpawnOpts;
+
+// Starts the executable at path. A file the kernel refuses with ENOEXEC,
+// such as a script without #!, is run by /bin/sh the way execvp does.
+int spawnFile(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions,
+    const posix_spawnattr_t* attr, char** argv) {
+  int err = posix_spawn(pid, path, actions, attr, argv, environ);
+  if (err != ENOEXEC) {
+    return err;
+  }
+  size_t argc = 0;
+  while (argv[argc] != NULL) {
+    ++argc;
+  }
+  char** shArgv = malloc((argc + 2) * sizeof(char*));
+  if (shArgv == NULL) {
+    return ENOMEM;
+  }
+  shArgv[0] = (char*)"/bin/sh";
+  shArgv[1] = (char*)path;
+  memcpy(shArgv + 2, argv + 1, argc * sizeof(char*));
+  err = posix_spawn(pid, "/bin/sh", actions, attr, shArgv, environ);
+  free(shArgv);
+  return err;
+}
+
+// Starts argv[0] as described by opts. The child is created with posix_spawn,
+// which does not copy the page tables of the shell. Descriptors the child must
+// not inherit have to be opened with O_CLOEXEC. Signals the interactive shell
+// ignores are reset to their defaults in the child.
+// A cached path that fails with ENOENT or EACCES is dropped and PATH is
+// searched once more, so a command moved since it was cached is found.
+// Returns 0 and stores the child pid into *pid, or an errno value on failure.
+// ENOENT means that the command was not found.
+int spawnCmd(char** argv, const SpawnOpts* opts, pid_t* pid) {
+  const char* path = argv[0];
+  PathEntry* e = NULL;
+  if (strchr(argv[0], '/') == NULL) {
+    e = lookupCmd(argv[0]);
+    if (e == NULL) {
+      return ENOENT;
+    }
+    path = e->path;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  int err = posix_spawn_file_actions_init(&actions);
+  if (err != 0) {
+    return err;
+  }
+  err = posix_spawnattr_init(&attr);
+  if (err != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+  }
+  for (size_t i = 0; err == 0 && i < opts->actionCount; ++i) {
+    const FdAction* a = &opts->actions[i];
+    if (a->src == -1) {
+      err = posix_spawn_file_actions_addclose(&actions, a->fd);
+    } else if (a->src != a->fd) {
+      err = posix_spawn_file_actions_adddup2(&actions, a->src, a->fd);
+    }
+  }
+  if (err == 0 && opts->tty != -1) {
+    err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, opts->tty);
+  }
+  short flags = POSIX_SPAWN_SETSIGDEF;
+  sigset_t def;
+  sigemptyset(&def);
+  sigaddset(&def, SIGINT);
+  sigaddset(&def, SIGQUIT);
+  sigaddset(&def, SIGTSTP);
+  sigaddset(&def, SIGTTIN);
+  sigaddset(&def, SIGTTOU);
+  if (err == 0) {
+    err = posix_spawnattr_setsigdefault(&attr, &def);
+  }
+  if (err == 0 && opts->pgid != -1) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    err = posix_spawnattr_setpgroup(&attr, opts->pgid);
+  }
+  if (err == 0) {
+    err = posix_spawnattr_setflags(&attr, flags);
+  }
+  if (err == 0) {
+    uint64_t start = nowUsec();
+    err = spawnFile(pid, path, &actions, &attr, argv);
+    if ((err == ENOENT || err == EACCES) && e != NULL) {
+      pathCacheRemove(e);
+      e = lookupCmd(argv[0]);
+      err = e == NULL ? ENOENT : spawnFile(pid, e->path, &actions, &attr, argv);
+    }
+    if (err == 0 && e != NULL) {
+      ++e->hits;
+      e->spawnUsec += nowUsec() - start;
+    }
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return err;
+}
+
+// Prints the cache in the format of the bash hash builtin, extended with
+// the average spawn latency of every command in microseconds.
+void pathCachePrint(FILE* stream) {
+  if (pathCache.count == 0) {
+    fprintf(stream, "hash: hash table empty\n");
+    return;
+  }
+  fprintf(stream, "hits\tspawn(us)\tcommand\n");
+  for (size_t i = 0; i < pathCache.cap; ++i) {
+    PathEntry* e = &pathCache.entries[i];
+    if (e->name == NULL) {
+      continue;
+    }
+    uint64_t avg = e->hits == 0 ? 0 : e->spawnUsec / e->hits;
+    fprintf(stream, "%4zu\t%9llu\t%s\n", e->hits, (unsigned long long)avg, e->path);
+  }
+}
@@ -1,72 +1,91 @@
 #include "../strings/strings.h"
+#include "../reader/reader.h"
 
 typedef enum Type{Command, Operator} Type;
 
+typedef enum RedirKind{RedirIn, RedirOut, RedirAppend, RedirDup, RedirHeredoc} RedirKind;
+
+// Redirect is a redirection of a command, applied to its descriptor fd.
+typedef struct Redirect {
+  RedirKind kind;
+  int fd;
+  // Operator as written, e.g. "2>>".
+  char* op;
+  // File name, descriptor number or "-" for RedirDup, delimiter for RedirHeredoc.
+  char* target;
+  // Here-document text.
+  char* body;
+  size_t bodyLen;
+} Redirect;
+
 typedef struct Cmd {
   Type type;
   char* command;
   char**  argv;
   size_t argc;
+  Redirect* redirs;
+  size_t redirCount;
 } Cmd;
 
-// Reads entire line from stream, storing the address of the buffer into *lineptr. 
-// Continues reading if the newline character was met inside double or single quotes or followed by backslash character.
-ssize_t getRawCmdLine(char** lineptr, FILE* stream) {
-  ssize_t cmdSize = 1;
-  if (*lineptr == NULL) {
-    *lineptr = malloc(cmdSize);
-  }
-  (*lineptr)[0] = '\0';
-
+// Reads entire line from stream, storing the address of the buffer into *lineptr
+// and its capacity into *n, the way getline does. The buffer is reused between calls.
+// Continues reading if the newline character was met inside double or single quotes or escaped by a backslash.
+// The quote state is carried from one physical line to the next, so every byte is scanned once
+// and a long continued line is assembled in linear time.
+ssize_t getRawCmdLine(char** lineptr, size_t* n, Reader* stream) {
+  size_t cmdSize = 0;
   enum State state = Outside;
   bool next;
   do {
     next = false;
-    char* line = NULL;
-    size_t n = 0;
-    ssize_t len = getline(&line, &n, stream);
+    const char* line = NULL;
+    ssize_t len = readerLine(stream, &line);
     if (len == -1) {
-      free(*lineptr);
-      free(line);
-      *lineptr = NULL;
-      return len;
+      // An unfinished line at the end of stream is run as it is.
+      if (cmdSize == 0) {
+        return len;
+      }
+      break;
     }
-    for (int i = 0; i < len; ++i) {
+    for (ssize_t i = 0; i < len; ++i) {
       char c = line[i];
       if (c == '\\' && (state == Outside || state == doubleQuote)) {
-        ++i;
+        // Only the last character of a line can be an escaped newline.
+        next = ++i < len && line[i] == '\n';
         continue;
       }
-      changeStateIfQuote(line[i], &state); 
+      changeStateIfQuote(c, &state); 
     }
-    if (state != Outside || (len > 1 && line[len-2] == '\\')) {
+    if (state != Outside) {
       next = true; 
     } 
-    cmdSize += len;
-    char* newCmdLine = realloc(*lineptr, cmdSize);
-    if (newCmdLine == NULL) {
-      free(*lineptr);
-      *lineptr = NULL;
-      return -1;
+    if (cmdSize + len + 1 > *n) {
+      size_t newCap = (cmdSize + len + 1) * 2;
+      char* newCmdLine = realloc(*lineptr, newCap);
+      if (newCmdLine == NULL) {
+        return -1;
+      }
+      *lineptr = newCmdLine;
+      *n = newCap;
     }
-    *lineptr = newCmdLine;
-    strcat(*lineptr, line);
-    free(line);
+    memcpy(*lineptr + cmdSize, line, len);
+    cmdSize += len;
   } while (next);
 
-  size_t len = strlen(*lineptr);
-  if((*lineptr)[len - 1] == '\n') {
-    (*lineptr)[len-1] = '\0';
+  if((*lineptr)[cmdSize - 1] == '\n') {
+    --cmdSize;
   }
-  return strlen(*lineptr);
+  (*lineptr)[cmdSize] = '\0';
+  return cmdSize;
 }
 
 bool isOperator(const char c) {
   return c == '|' || 
          c == '&' ||
          c == '>' ||
+         c == '<' ||
          c == ' ' ||
-         c == '&' ||
+         c == ';' ||
          c == '#';
 }
 
@@ -101,65 +120,190 @@ void cmdFree(Cmd* cmd, size_t count) {
       free((cmd[i].argv)[j]);
     }
     free(cmd[i].argv);
+    for (size_t j = 0; j < cmd[i].redirCount; ++j) {
+      free(cmd[i].redirs[j].op);
+      free(cmd[i].redirs[j].target);
+      free(cmd[i].redirs[j].body);
+    }
+    free(cmd[i].redirs);
   }
   free(cmd);
 }
 
-ssize_t cmdFill(Cmd* cmd, char** cmdToken, Type type) {
-  char* token = *cmdToken;
-  cmd->type = type;
-  cmd->command = token; 
-  cmd->argv = NULL;
-  cmd->argc = 0;
+// Tells whether token is a redirection operator: [n]<, [n]>, [n]>>, [n]>&,
+// [n]<& or [n]<<.
+bool isRedirectOp(const char* token) {
+  while (*token >= '0' && *token <= '9') {
+    ++token;
+  }
+  return *token == '<' || *token == '>';
+}
 
-  char** p = NULL;
-  if (type == Command) {
-    size_t count = 0, cap = 0;
-    ssize_t err = strResize(&p, &cap);
-    if (err == -1) {
-      return err;
+// Fills a redirection from its operator and target tokens, taking both.
+// targetOp tells whether the target is an unquoted operator. Returns -2 if the
+// target is missing or is not valid for the operator.
+ssize_t redirFill(Redirect* r, char* op, char* target, bool targetOp) {
+  r->op = op;
+  r->target = target;
+  r->body = NULL;
+  r->bodyLen = 0;
+  char* p = op;
+  int fd = -1;
+  if (*p >= '0' && *p <= '9') {
+    fd = strtol(op, &p, 10);
+  }
+  if (p[0] == '<') {
+    r->kind = p[1] == '<' ? RedirHeredoc : (p[1] == '&' ? RedirDup : RedirIn);
+    r->fd = fd == -1 ? STDIN_FILENO : fd;
+  } else {
+    r->kind = p[1] == '>' ? RedirAppend : (p[1] == '&' ? RedirDup : RedirOut);
+    r->fd = fd == -1 ? STDOUT_FILENO : fd;
+  }
+  if (target == NULL || targetOp) {
+    fprintf(stderr, "syntax error near unexpected token `%s'\n",
+        target == NULL ? "newline" : target);
+    return -2;
+  }
+  if (r->kind == RedirHeredoc) {
+    // The delimiter is not expanded, a $? in it stands for itself.
+    r->target = unmarkStatus(target);
+    return r->target == NULL ? -1 : 0;
+  }
+  // A target with $? is checked once it is expanded.
+  if (r->kind == RedirDup && strcmp(target, "-") != 0 &&
+      strchr(target, StatusMarker) == NULL) {
+    char* end = target;
+    strtol(target, &end, 10);
+    if (end == target || *end != '\0') {
+      fprintf(stderr, "%s: ambiguous redirect\n", target);
+      return -2;
     }
-    p[count++] = token;
-
-    token = Strtok(NULL, isOperator);
-    while (token != NULL && !isOperator(*token)) {
-      if (count + 1 > cap) {
-        err = strResize(&p, &cap);
-        if (err == -1) {
-          for (size_t j = 0; j < count; ++j) {
-            free(p[j]);
-          }
-          free(p);
-          return err;
+  }
+  return 0;
+}
+
+void redirsFree(Redirect* redirs, size_t count) {
+  for (size_t j = 0; j < count; ++j) {
+    free(redirs[j].op);
+    free(redirs[j].target);
+  }
+  free(redirs);
+}
+
+// Collects the words and redirections of a simple command, starting with
+// *cmdToken, until an operator other than a redirection. *op tells whether
+// the current token is an operator. A command may consist of redirections
+// only, then its argc is 0 and command is an empty string.
+// Returns -1 if memory could not be allocated, -2 on a syntax error.
+ssize_t commandFill(Cmd* cmd, char** cmdToken, bool* op) {
+  char* token = *cmdToken;
+  char** p = NULL;
+  size_t count = 0, cap = 0;
+  Redirect* redirs = NULL;
+  size_t redirCount = 0, redirCap = 0;
+  ssize_t err = 0;
+  while (err == 0 && token != NULL && (!*op || isRedirectOp(token))) {
+    if (*op) {
+      if (redirCount + 1 > redirCap) {
+        redirCap = (redirCap + 1) * 2;
+        Redirect* np = realloc(redirs, redirCap * sizeof(Redirect));
+        if (np == NULL) {
+          free(token);
+          err = -1;
+          break;
         }
+        redirs = np;
       }
+      bool targetOp = false;
+      char* target = Strtok(NULL, isOperator, &targetOp);
+      err = redirFill(&redirs[redirCount++], token, target, targetOp);
+    } else if (count + 2 > cap && strResize(&p, &cap) == -1) {
+      free(token);
+      err = -1;
+    } else {
       p[count++] = token;
-      token = Strtok(NULL, isOperator); 
     }
-    if (count + 1 > cap) {
-      err = strResize(&p, &cap);
-      if (err == -1) {
-        for (size_t j = 0; j < count; ++j) {
-          free(p[j]);
+    token = err == 0 ? Strtok(NULL, isOperator, op) : NULL;
+  }
+  if (err == 0 && count + 1 > cap) {
+    err = strResize(&p, &cap);
+  }
+  if (err != 0) {
+    for (size_t j = 0; j < count; ++j) {
+      free(p[j]);
+    }
+    free(p);
+    redirsFree(redirs, redirCount);
+    *cmdToken = NULL;
+    return err;
+  }
+  p[count] = NULL;
+  cmd->type = Command;
+  cmd->command = count > 0 ? p[0] : calloc(1, 1);
+  cmd->argv = p;
+  cmd->argc = count;
+  cmd->redirs = redirs;
+  cmd->redirCount = redirCount;
+  *cmdToken = token;
+  return 0;
+}
+
+ssize_t cmdFill(Cmd* cmd, char** cmdToken, bool* op, Type type) {
+  if (type == Command) {
+    return commandFill(cmd, cmdToken, op);
+  }
+  cmd->type = type;
+  cmd->command = *cmdToken;
+  cmd->argv = NULL;
+  cmd->argc = 0;
+  cmd->redirs = NULL;
+  cmd->redirCount = 0;
+  *cmdToken = Strtok(NULL, isOperator, op);
+  return 0;
+}
+
+// Reads the bodies of the here-documents of the line from stream, in the order
+// the << operators appear. A body ends with a line equal to its delimiter or
+// with the end of stream.
+ssize_t readHeredocs(Cmd* cmds, size_t count, Reader* stream) {
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < cmds[i].redirCount; ++j) {
+      Redirect* r = &cmds[i].redirs[j];
+      if (r->kind != RedirHeredoc) {
+        continue;
+      }
+      size_t delimLen = strlen(r->target);
+      size_t cap = 0;
+      const char* line = NULL;
+      ssize_t len;
+      while ((len = readerLine(stream, &line)) != -1) {
+        size_t textLen = line[len - 1] == '\n' ? len - 1 : len;
+        if (textLen == delimLen && memcmp(line, r->target, delimLen) == 0) {
+          break;
         }
-        free(p);
-        return err;
+        if (r->bodyLen + len > cap) {
+          cap = (r->bodyLen + len) * 2;
+          char* np = realloc(r->body, cap);
+          if (np == NULL) {
+            return -1;
+          }
+          r->body = np;
+        }
+        memcpy(r->body + r->bodyLen, line, len);
+        r->bodyLen += len;
       }
     }
-    p[count] = NULL;
-    cmd->argc = count;
-    cmd->argv = p;
-  } else {
-    token = Strtok(NULL, isOperator); 
   }
-  *cmdToken = token;
   return 0;
 }
 
-ssize_t getCmds(Cmd** cmds, FILE* stream) {
+// Reads and splits the next command line. Returns the number of commands, which
+// is 0 for a blank line, -1 at the end of stream and -2 on a syntax error.
+ssize_t getCmds(Cmd** cmds, Reader* stream) {
   char* rawCmdLine = NULL;
-  ssize_t len = getRawCmdLine(&rawCmdLine, stream);
-  if (len == -1 || len == 0) {
+  size_t rawCap = 0;
+  ssize_t len = getRawCmdLine(&rawCmdLine, &rawCap, stream);
+  if (len == -1) {
     free(rawCmdLine);
     return -1;
   }
@@ -167,35 +311,40 @@ ssize_t getCmds(Cmd** cmds, FILE* stream) {
   Cmd* lcmds = NULL;
   size_t count = 0, cap = 0;
 
-  char* token = Strtok(rawCmdLine, isOperator);
+  bool op = false;
+  char* token = Strtok(rawCmdLine, isOperator, &op);
   while (token != NULL) {
     if (count + 1 > cap) {
       ssize_t err = cmdResize(&lcmds, &cap);
       if (err == -1) {
         cmdFree(lcmds, count);
+        free(token);
         free(rawCmdLine);
         return err;
       }
     }
-    if (*token == '#') {
+    if (op && *token == '#') {
       free(token);
       break; 
     }
     ssize_t err = 0; 
-    if (isOperator(*token)) {
-      err = cmdFill(&(lcmds[count]), &token, Operator); 
+    if (op && !isRedirectOp(token)) {
+      err = cmdFill(&(lcmds[count]), &token, &op, Operator); 
     } else {
-      err = cmdFill(&(lcmds[count]), &token, Command); 
+      err = cmdFill(&(lcmds[count]), &token, &op, Command); 
     }
-    if (err == -1) {
+    if (err != 0) {
       cmdFree(lcmds, count);
-      free(token);
       free(rawCmdLine);
       return err;
     }
     ++count;
   }
-  *cmds = lcmds;
   free(rawCmdLine);
+  if (readHeredocs(lcmds, count, stream) == -1) {
+    cmdFree(lcmds, count);
+    return -1;
+  }
+  *cmds = lcmds;
   return count;
 }
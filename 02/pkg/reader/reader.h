@@ -0,0 +1,162 @@
+#pragma once
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+enum {
+  READER_BUF_SIZE = 64 * 1024,
+};
+
+// Reader hands out physical lines of a command stream. A regular file is
+// mapped into memory as a whole, anything else is read in big chunks, so
+// a line costs a memchr instead of a system call.
+typedef struct Reader {
+  int fd;
+  char* buf;
+  size_t cap;
+  // Unread data is buf[start..end).
+  size_t start;
+  size_t end;
+  // Whether buf is a mapping of the file, a buffer owned by the reader or
+  // a string given by the caller.
+  bool mapped;
+  bool owned;
+  bool eof;
+  // Whether fd is a seekable file children inherit, whose offset has to
+  // follow the consumed input, see readerSync.
+  bool shared;
+} Reader;
+
+// Prepares r to read from fd. Returns -1 if memory could not be allocated.
+int readerOpen(Reader* r, int fd) {
+  memset(r, 0, sizeof(Reader));
+  r->fd = fd;
+  int fdFlags = fcntl(fd, F_GETFD);
+  r->shared = fdFlags != -1 && !(fdFlags & FD_CLOEXEC) && lseek(fd, 0, SEEK_CUR) != -1;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pos >= 0 && pos <= st.st_size && p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      r->buf = p;
+      r->cap = st.st_size;
+      r->start = pos;
+      r->end = st.st_size;
+      r->mapped = true;
+      r->eof = true;
+      return 0;
+    }
+    if (p != MAP_FAILED) {
+      munmap(p, st.st_size);
+    }
+  }
+  r->buf = malloc(READER_BUF_SIZE);
+  if (r->buf == NULL) {
+    return -1;
+  }
+  r->cap = READER_BUF_SIZE;
+  r->owned = true;
+  return 0;
+}
+
+// Prepares r to read lines from the string s, which must outlive r.
+void readerOpenString(Reader* r, const char* s) {
+  memset(r, 0, sizeof(Reader));
+  r->fd = -1;
+  r->buf = (char*)s;
+  r->end = strlen(s);
+  r->cap = r->end;
+  r->eof = true;
+}
+
+void readerClose(Reader* r) {
+  if (r->mapped) {
+    munmap(r->buf, r->cap);
+  } else if (r->owned) {
+    free(r->buf);
+  }
+  r->buf = NULL;
+}
+
+// Moves the offset of a shared fd to the first unread byte, so a child
+// reading its standard input starts right after the consumed commands, as
+// with bash. Buffered data is dropped and read again later.
+void readerSync(Reader* r) {
+  if (!r->shared) {
+    return;
+  }
+  if (r->mapped) {
+    lseek(r->fd, r->start, SEEK_SET);
+  } else if (lseek(r->fd, -(off_t)(r->end - r->start), SEEK_CUR) != -1) {
+    r->start = r->end = 0;
+    r->eof = false;
+  }
+}
+
+// Continues reading from the offset of a shared fd, where the children
+// started since readerSync left it.
+void readerResume(Reader* r) {
+  if (!r->mapped || !r->shared) {
+    return;
+  }
+  off_t pos = lseek(r->fd, 0, SEEK_CUR);
+  if (pos >= 0 && (size_t)pos <= r->cap) {
+    r->start = pos;
+  }
+}
+
+// Reads more data into the buffer, moving unread data to its beginning and
+// growing it when a line does not fit. Returns false at the end of input.
+bool readerFill(Reader* r) {
+  if (r->eof) {
+    return false;
+  }
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->end == r->cap) {
+    char* np = realloc(r->buf, r->cap * 2);
+    if (np == NULL) {
+      return false;
+    }
+    r->buf = np;
+    r->cap *= 2;
+  }
+  ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end);
+  if (n <= 0) {
+    r->eof = true;
+    return false;
+  }
+  r->end += n;
+  return true;
+}
+
+// Stores into *line the address of the next line including its '\n', if any.
+// The line stays valid until the next call. Returns its length or -1 at the
+// end of input.
+ssize_t readerLine(Reader* r, const char** line) {
+  size_t scanned = r->start;
+  char* nl = NULL;
+  while ((nl = memchr(r->buf + scanned, '\n', r->end - scanned)) == NULL) {
+    scanned = r->end - r->start;
+    if (!readerFill(r)) {
+      break;
+    }
+    scanned += r->start;
+  }
+  if (r->start == r->end) {
+    return -1;
+  }
+  size_t len = nl == NULL ? r->end - r->start : (size_t)(nl - (r->buf + r->start)) + 1;
+  *line = r->buf + r->start;
+  r->start += len;
+  return len;
+}
@@ -1,10 +1,15 @@
 #pragma once
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
 enum State{singleQuote='\'', doubleQuote='\"', Outside=-1};
 
+// Stands for an unquoted or double-quoted $? in a cleaned token. It is replaced
+// with the status of the last pipeline right before the command is run.
+enum {StatusMarker = '\001'};
+
 void changeStateIfQuote(const char c, enum State* state) {
   //only if we get out of the quotation
   if (c == *state) {    
@@ -19,57 +24,75 @@ void changeStateIfQuote(const char c, enum State* state) {
   return;
 }
 
-// Cleans s according to Bash grammar rules for future use in execvp.
-void cleanString(char* s) {
+// Cleans the word s[0..n) according to Bash grammar rules for future use in
+// execvp and writes the result into out, which must have room for n + 1 bytes.
+// Quotes are removed, backslash escapes and line continuations are resolved and
+// $? outside single quotes becomes StatusMarker. Every byte is visited once.
+size_t cleanWord(const char* s, size_t n, char* out) {
   enum State state = Outside;
-  size_t i = 0;
-  while (i < strlen(s)) {
-    changeStateIfQuote(s[i], &state);
-    if (state == Outside) {
-      for (; i < strlen(s); ++i) {
-        if (s[i] == '\\') {
-          if (s[i+1] == '\n') {
-            memmove(s + i, s + i + 2, strlen(s + i + 1));
-          } else {
-            memmove(s + i, s + i + 1, strlen(s + i)); 
-          }
-          continue;
-        }
-        changeStateIfQuote(s[i], &state);
-        if (state != Outside) {
-          break;
-        }
+  size_t j = 0;
+  for (size_t i = 0; i < n; ++i) {
+    char c = s[i];
+    if (state == singleQuote) {
+      if (c == singleQuote) {
+        state = Outside;
+      } else {
+        out[j++] = c;
       }
-    } else if (state == doubleQuote) {
-      memmove(s + i, s + i + 1, strlen(s + i));
-      for (; i < strlen(s); ++i) {
-        if (s[i] == '\\') {
-          if (s[i+1] == '\\') {
-            memmove(s + i, s + i + 1, strlen(s + i));
-          } else if (s[i+1] == '\n') {
-            memmove(s + i, s + i + 2, strlen(s + i + 1));
-          } else if (s[i+1] == '\"') {
-            memmove(s + i, s + i + 1, strlen(s + i)); 
-          }
-          continue;
-        }
-        changeStateIfQuote(s[i], &state);
-        if (state != doubleQuote) {
-          break;
-        }
+      continue;
+    }
+    if (c == '\\') {
+      if (++i == n || s[i] == '\n') {
+        continue;
       }
-      memmove(s + i, s + i + 1, strlen(s + i));
-    } else if (state == singleQuote) {
-      memmove(s + i, s + i + 1, strlen(s + i));
-      for (; i < strlen(s) && state == singleQuote; ++i) {
-        changeStateIfQuote(s[i], &state);
-        if (state != singleQuote) {
-          break;
-        }
+      // Inside double quotes a backslash only escapes \, " and $.
+      if (state == doubleQuote && s[i] != '\\' && s[i] != doubleQuote && s[i] != '$') {
+        out[j++] = '\\';
       }
-      memmove(s + i, s + i + 1, strlen(s + i));
+      out[j++] = s[i];
+      continue;
     }
+    if (c == '$' && i + 1 < n && s[i + 1] == '?') {
+      out[j++] = StatusMarker;
+      ++i;
+      continue;
+    }
+    if (c == doubleQuote || (c == singleQuote && state == Outside)) {
+      changeStateIfQuote(c, &state);
+      continue;
+    }
+    out[j++] = c;
   }
+  out[j] = '\0';
+  return j;
+}
+
+// Turns each StatusMarker of word back into the $? it came from, for words
+// that are not expanded. Takes word and returns the result, or NULL if out of
+// memory.
+char* unmarkStatus(char* word) {
+  size_t markers = 0;
+  for (const char* c = word; *c != '\0'; ++c) {
+    markers += *c == StatusMarker;
+  }
+  if (markers == 0) {
+    return word;
+  }
+  char* res = malloc(strlen(word) + markers + 1);
+  if (res != NULL) {
+    char* p = res;
+    for (const char* c = word; *c != '\0'; ++c) {
+      if (*c == StatusMarker) {
+        *p++ = '$';
+        *p++ = '?';
+      } else {
+        *p++ = *c;
+      }
+    }
+    *p = '\0';
+  }
+  free(word);
+  return res;
 }
 
 bool isSpace(const char c) {
@@ -79,10 +102,12 @@ bool isSpace(const char c) {
 typedef bool (*func)(const char);
 
 // Strtok splits the string s at each run of ASCII code points c satisfying func(c). 
-// Delimiters are also returned except for the whitecpace characters.
+// Delimiters are also returned except for the whitecpace characters, *op tells
+// whether the returned token is one. A quoted delimiter is part of a word.
 // Returned tokens are processed to follow Bash (Bourne Again Shell) grammar rules.
 // Doesn't modify the origin string s. Each returned token must be freed. 
-char* Strtok(const char* s, func delim) {
+// The string is scanned once: a word is found in one pass and cleaned in another.
+char* Strtok(const char* s, func delim, bool* op) {
   static const char* input = NULL;
   if (s != NULL) {
     input = s;
@@ -90,56 +115,59 @@ char* Strtok(const char* s, func delim) {
   if (input == NULL) {
     return NULL;
   }
-  size_t fieldStart = 0;
-  size_t i = 0;
-  while (i < strlen(input) && isSpace(input[i])) {
-    ++i; 
+  const char* start = input;
+  while (isSpace(*start)) {
+    ++start;
+  }
+  if (*start == '\0') {
+    input = NULL;
+    return NULL;
   }
-  fieldStart = i;
 
-  if (delim(input[i])) {
-    char* res = malloc(3);
-    if (input[i] == input[i+1]) {
-      memmove(res, input + i, 2);
-      res[2] = '\0';
-      input += i + 2;
-    } else {
-      memmove(res, input + i, 1);
-      res[1] = '\0';
-      input += i + 1;
+  // Digits right before < or > are the descriptor of a redirection
+  // and belong to the operator, as in 2>&1.
+  const char* end = start;
+  while (*end >= '0' && *end <= '9') {
+    ++end;
+  }
+  if (end == start || (*end != '<' && *end != '>')) {
+    end = start;
+  }
+  if (delim(*end)) {
+    char c = *end++;
+    if ((c == '<' || c == '>') && *end == '&') {
+      ++end;
+    } else if (*end == c) {
+      ++end;
+    }
+    size_t n = end - start;
+    char* res = malloc(n + 1);
+    if (res != NULL) {
+      memcpy(res, start, n);
+      res[n] = '\0';
     }
+    *op = true;
+    input = end;
     return res;
   }
 
   enum State state = Outside;
-  for (; i < strlen(input); ++i) {
-    if (input[i] == '\\' && (state == Outside || state == doubleQuote)) {
-      ++i;
+  for (; *end != '\0'; ++end) {
+    if (*end == '\\' && state != singleQuote) {
+      end += end[1] != '\0';
       continue;
     }
-    if (state == Outside) {
-      if (delim(input[i])) {
-        size_t n = i - fieldStart;
-        char* res = malloc(n + 1);
-        memmove(res, input + fieldStart, n);
-        res[n] = '\0';
-        cleanString(res);
-        input += i;
-        return res;
-      }
+    if (state == Outside && delim(*end)) {
+      break;
     }
-    changeStateIfQuote(input[i], &state);
+    changeStateIfQuote(*end, &state);
   }
-
-  if (fieldStart < strlen(input)) {
-    size_t n = i - fieldStart;
-    char* res = malloc(n + 1);
-    memmove(res, input + fieldStart, n);
-    res[n] = '\0';
-    cleanString(res);
-    input = NULL;
-    return res;
+  size_t n = end - start;
+  char* res = malloc(n + 1);
+  if (res != NULL) {
+    cleanWord(start, n, res);
   }
-  input = NULL;
-  return NULL; 
+  *op = false;
+  input = end;
+  return res;
 }
@@ -0,0 +1,113 @@
+#pragma once
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "../jobs/jobs.h"
+
+// Descriptor the trace is written to as JSON lines, -1 when tracing is off.
+static int traceFd = -1;
+
+void traceString(FILE* out, const char* s) {
+  fputc('"', out);
+  for (; s != NULL && *s != '\0'; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+long long timevalUsec(const struct timeval* tv) {
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+// Writes a record collected in a memory stream with one write(2), so records
+// of concurrent shells do not interleave in a file opened with O_APPEND.
+void traceFlush(FILE* out, char** buf, size_t* len) {
+  fclose(out);
+  size_t off = 0;
+  while (off < *len) {
+    ssize_t n = write(traceFd, *buf + off, *len - off);
+    if (n <= 0) {
+      break;
+    }
+    off += n;
+  }
+  free(*buf);
+}
+
+// Writes a record per process of a finished job and one for the whole
+// pipeline. Times are in microseconds: spawn_us is the posix_spawn or fork
+// call, exec_us is the time from then until the process was reaped and wall_us
+// is both. CPU times and the peak RSS come from wait4. redir_bytes counts what
+// went through the files opened for redirections of the stage.
+void traceJob(const Job* job) {
+  char* buf = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&buf, &len);
+  if (out == NULL) {
+    return;
+  }
+  uint64_t end = job->startUsec;
+  for (size_t i = 0; i < job->count; ++i) {
+    const Proc* proc = &job->procs[i];
+    uint64_t procEnd = proc->pid == -1 ? proc->startUsec + proc->spawnUsec : proc->endUsec;
+    end = procEnd > end ? procEnd : end;
+    long long redirBytes = 0;
+    for (size_t j = 0; j < proc->redirCount; ++j) {
+      off_t pos = lseek(proc->redirs[j].fd, 0, SEEK_CUR);
+      redirBytes += pos > proc->redirs[j].start ? pos - proc->redirs[j].start : 0;
+    }
+    fprintf(out, "{\"type\":\"stage\",\"job\":%d,\"stage\":%zu,\"cmd\":", job->id, i);
+    traceString(out, proc->name);
+    fprintf(out, ",\"pid\":%d,\"status\":%d,\"spawn_us\":%llu,\"exec_us\":%llu,"
+        "\"wall_us\":%llu,\"user_us\":%lld,\"sys_us\":%lld,\"maxrss_kb\":%ld,"
+        "\"redir_bytes\":%lld}\n",
+        proc->pid, exitStatus(proc->status),
+        (unsigned long long)proc->spawnUsec,
+        (unsigned long long)(procEnd - proc->startUsec - proc->spawnUsec),
+        (unsigned long long)(procEnd - proc->startUsec),
+        timevalUsec(&proc->usage.ru_utime), timevalUsec(&proc->usage.ru_stime),
+        proc->usage.ru_maxrss, redirBytes);
+  }
+  fprintf(out, "{\"type\":\"pipeline\",\"job\":%d,\"cmd\":", job->id);
+  traceString(out, job->cmdline);
+  fprintf(out, ",\"background\":%s,\"stages\":%zu,\"status\":%d,\"wall_us\":%llu}\n",
+      job->background ? "true" : "false", job->count, exitStatus(jobStatus(job)),
+      (unsigned long long)(end - job->startUsec));
+  traceFlush(out, &buf, &len);
+}
+
+// Writes a record for a builtin run by the shell itself.
+void traceBuiltin(const char* name, uint64_t startUsec, int status) {
+  char* buf = NULL;
+  size_t len = 0;
+  FILE* out = open_memstream(&buf, &len);
+  if (out == NULL) {
+    return;
+  }
+  fprintf(out, "{\"type\":\"builtin\",\"cmd\":");
+  traceString(out, name);
+  fprintf(out, ",\"status\":%d,\"wall_us\":%llu}\n", status,
+      (unsigned long long)(nowUsec() - startUsec));
+  traceFlush(out, &buf, &len);
+}
+
+// Turns tracing on. Returns -1 if fd is not an open descriptor. The descriptor
+// is not inherited by the commands.
+int traceInit(int fd) {
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    return -1;
+  }
+  traceFd = fd;
+  jobTable.onDone = traceJob;
+  return 0;
+}
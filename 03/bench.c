@@ -0,0 +1,613 @@
+#include "userfs.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Throughput benchmark of userfs. Every case writes a file of
+ * the given size sequentially in chunks of the given size,
+ * then reads it back the same way; the mapped line shows the
+ * memory the file took. The bs cases do the same in 1 MiB
+ * chunks with block sizes of 4 KiB, 64 KiB and 2 MiB, the
+ * chunk column holding the block size, and time a resize to
+ * the file size. The scan cases sum the bytes of the file read
+ * with copies and with views. The copy cases copy a sparse
+ * file as a whole and skipping holes. The random cases write
+ * and read 4 KiB chunks at random offsets of a file written in
+ * full first, with ufs_pwrite() and ufs_pread() and a fixed
+ * seed. They run on a 16 MiB file and on one of the given
+ * size, each after a rand_file line with the file size. The
+ * block lookup costs the same in both, so a gap between them
+ * comes from the data outgrowing the CPU caches. The image
+ * cases save a file to an image, mount it back and read the
+ * file from the mapped image. The clone cases clone a file of
+ * the given size and write 4 KiB into every MiB of the clone.
+ * The resize case shrinks and grows a file while many
+ * descriptors of another file are open. The open/close case
+ * creates many files and then opens and closes each of them by
+ * name. The deep_open case opens a file 16 directories deep,
+ * the readdir case lists a directory of 1000 files among 100
+ * such. The descriptor case keeps many descriptors open,
+ * reopens one of them over and over and writes through the
+ * newest one. The thread cases read files of 64 MiB with 1, 2,
+ * 4... threads up to the number of CPUs, each thread its own
+ * file or all of them one shared file. For them the chunk
+ * column holds the number of threads.
+ *
+ * Usage: bench.out [size_mib]
+ * size_mib is the file size, 1024 (the maximal one) by default.
+ */
+
+static double
+now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, size_t chunk, size_t bytes, double sec)
+{
+  printf("%-12s %10zu %12zu %10.3f %10.1f\n", name, chunk, bytes, sec,
+         bytes / sec / (1024 * 1024));
+}
+
+/**
+ * Sums the bytes of the bench file once through copies into a
+ * buffer and once through read views.
+ */
+static void
+bench_scan(void)
+{
+  static char buf[64 * 1024];
+  int fd = ufs_open("bench", 0);
+  double start = now_sec();
+  size_t done = 0;
+  unsigned sum = 0;
+  ssize_t rc;
+  while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < rc; ++i) {
+      sum += (unsigned char) buf[i];
+    }
+    done += rc;
+  }
+  report("scan_copy", sizeof(buf), done, now_sec() - start);
+  ufs_close(fd);
+
+  fd = ufs_open("bench", 0);
+  start = now_sec();
+  done = 0;
+  struct ufs_view view;
+  while ((rc = ufs_read_view(fd, &view)) > 0) {
+    for (ssize_t i = 0; i < rc; ++i) {
+      sum += (unsigned char) view.data[i];
+    }
+    done += rc;
+    ufs_release_view(&view);
+  }
+  report("scan_view", sizeof(buf), done, now_sec() - start);
+  ufs_close(fd);
+  if (sum == 1) {
+    printf("%u\n", sum);
+  }
+}
+
+static void
+bench_sequential(size_t file_size, size_t chunk)
+{
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  int fd = ufs_open("bench", UFS_CREATE);
+  double start = now_sec();
+  size_t done = 0;
+  while (done < file_size) {
+    ssize_t rc = ufs_write(fd, buf, chunk);
+    if (rc <= 0) {
+      break;
+    }
+    done += rc;
+  }
+  report("seq_write", chunk, done, now_sec() - start);
+  struct ufs_stats stats;
+  ufs_get_stats(&stats);
+  printf("%-12s %10zu %12zu\n", "mapped", chunk, stats.mapped_bytes);
+  ufs_close(fd);
+
+  fd = ufs_open("bench", 0);
+  start = now_sec();
+  done = 0;
+  ssize_t rc;
+  while ((rc = ufs_read(fd, buf, chunk)) > 0) {
+    done += rc;
+  }
+  report("seq_read", chunk, done, now_sec() - start);
+  ufs_close(fd);
+
+  if (chunk == 4096) {
+    bench_scan();
+  }
+  ufs_delete("bench");
+  free(buf);
+}
+
+static void
+bench_random(size_t file_size, size_t chunk, int rounds)
+{
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  int fd = ufs_open("bench", UFS_CREATE);
+  size_t chunks = file_size / chunk;
+  for (size_t i = 0; i < chunks; ++i) {
+    if (ufs_pwrite(fd, buf, chunk, i * chunk) <= 0) {
+      chunks = 0;
+      break;
+    }
+  }
+  if (chunks == 0) {
+    ufs_close(fd);
+    ufs_delete("bench");
+    free(buf);
+    return;
+  }
+  printf("%-12s %10zu %12zu\n", "rand_file", chunk, chunks * chunk);
+  uint64_t seed = 88172645463325252ULL;
+  double start = now_sec();
+  size_t done = 0;
+  for (int i = 0; i < rounds; ++i) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    ssize_t rc = ufs_pwrite(fd, buf, chunk, seed % chunks * chunk);
+    done += rc > 0 ? rc : 0;
+  }
+  report("rand_write", chunk, done, now_sec() - start);
+
+  start = now_sec();
+  done = 0;
+  for (int i = 0; i < rounds; ++i) {
+    seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+    ssize_t rc = ufs_pread(fd, buf, chunk, seed % chunks * chunk);
+    done += rc > 0 ? rc : 0;
+  }
+  report("rand_read", chunk, done, now_sec() - start);
+  ufs_close(fd);
+  ufs_delete("bench");
+  free(buf);
+}
+
+/**
+ * Writes and reads a file in 1 MiB chunks with the given block
+ * size, then times growing it to the given size by a resize.
+ */
+static void
+bench_block_size(size_t file_size, size_t block_size)
+{
+  size_t chunk = 1024 * 1024;
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  int fd = ufs_open("bench", UFS_CREATE);
+  ufs_set_block_size(fd, block_size);
+  double start = now_sec();
+  size_t done = 0;
+  while (done < file_size) {
+    ssize_t rc = ufs_pwrite(fd, buf, chunk, done);
+    if (rc <= 0) {
+      break;
+    }
+    done += rc;
+  }
+  report("bs_write", block_size, done, now_sec() - start);
+  start = now_sec();
+  done = 0;
+  ssize_t rc;
+  while ((rc = ufs_pread(fd, buf, chunk, done)) > 0) {
+    done += rc;
+  }
+  report("bs_read", block_size, done, now_sec() - start);
+
+  ufs_resize(fd, 0);
+  start = now_sec();
+  ufs_resize(fd, file_size);
+  report("bs_prealloc", block_size, file_size, now_sec() - start);
+  ufs_close(fd);
+  ufs_delete("bench");
+  free(buf);
+}
+
+/**
+ * Copies a file of the given size with one 64 KiB block of
+ * data per MiB, once reading all of it and once skipping the
+ * holes with ufs_lseek().
+ */
+static void
+bench_sparse_copy(size_t file_size)
+{
+  size_t chunk = 64 * 1024;
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  int src = ufs_open("bench", UFS_CREATE);
+  ufs_resize(src, file_size);
+  for (size_t off = 0; off < file_size; off += 1024 * 1024) {
+    ufs_pwrite(src, buf, chunk, off);
+  }
+
+  int dst = ufs_open("bench_copy", UFS_CREATE);
+  double start = now_sec();
+  size_t done = 0;
+  ssize_t rc;
+  while ((rc = ufs_pread(src, buf, chunk, done)) > 0) {
+    ufs_pwrite(dst, buf, rc, done);
+    done += rc;
+  }
+  report("copy_full", chunk, done, now_sec() - start);
+  ufs_close(dst);
+  ufs_delete("bench_copy");
+
+  dst = ufs_open("bench_copy", UFS_CREATE);
+  start = now_sec();
+  off_t data = 0;
+  while ((data = ufs_lseek(src, data, UFS_SEEK_DATA)) >= 0) {
+    off_t hole = ufs_lseek(src, data, UFS_SEEK_HOLE);
+    for (; data < hole; data += rc) {
+      size_t n = hole - data < (off_t)chunk ? (size_t)(hole - data) : chunk;
+      rc = ufs_pread(src, buf, n, data);
+      ufs_pwrite(dst, buf, rc, data);
+    }
+  }
+  ufs_resize(dst, file_size);
+  report("copy_sparse", chunk, file_size, now_sec() - start);
+  ufs_close(dst);
+  ufs_delete("bench_copy");
+  ufs_close(src);
+  ufs_delete("bench");
+  free(buf);
+}
+
+/**
+ * Saves a file of the given size to an image, loads it back
+ * and reads it from the mapped image.
+ */
+static void
+bench_image(size_t file_size)
+{
+  const char *path = "bench_image.ufs";
+  size_t chunk = 1024 * 1024;
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  unlink(path);
+  if (ufs_mount(path) == -1) {
+    free(buf);
+    return;
+  }
+  int fd = ufs_open("bench", UFS_CREATE);
+  for (size_t done = 0; done < file_size; done += chunk) {
+    ufs_write(fd, buf, chunk);
+  }
+  ufs_close(fd);
+  double start = now_sec();
+  ufs_sync();
+  report("sync", chunk, file_size, now_sec() - start);
+  ufs_delete("bench");
+
+  start = now_sec();
+  ufs_mount(path);
+  report("mount", chunk, file_size, now_sec() - start);
+  fd = ufs_open("bench", 0);
+  start = now_sec();
+  size_t done = 0;
+  ssize_t rc;
+  while ((rc = ufs_read(fd, buf, chunk)) > 0) {
+    done += rc;
+  }
+  report("image_read", chunk, done, now_sec() - start);
+  ufs_close(fd);
+  ufs_delete("bench");
+  unlink(path);
+  free(buf);
+}
+
+/**
+ * Clones a file of the given size and writes 4 KiB into every
+ * MiB of the clone, which copies the blocks written to.
+ */
+static void
+bench_clone(size_t file_size)
+{
+  size_t chunk = 1024 * 1024;
+  char *buf = malloc(chunk);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', chunk);
+  int fd = ufs_open("bench", UFS_CREATE);
+  for (size_t done = 0; done < file_size; done += chunk) {
+    ufs_write(fd, buf, chunk);
+  }
+  ufs_close(fd);
+  double start = now_sec();
+  ufs_clone("bench", "bench_clone");
+  report("clone", chunk, file_size, now_sec() - start);
+
+  fd = ufs_open("bench_clone", 0);
+  start = now_sec();
+  for (size_t off = 0; off < file_size; off += chunk) {
+    ufs_pwrite(fd, buf, 4096, off);
+  }
+  report("clone_write", 4096, file_size / chunk * 4096, now_sec() - start);
+  ufs_close(fd);
+  ufs_delete("bench_clone");
+  ufs_delete("bench");
+  free(buf);
+}
+
+static void
+bench_resize(int other_fds, int rounds)
+{
+  int fd = ufs_open("bench", UFS_CREATE);
+  int *fds = malloc(other_fds * sizeof(int));
+  if (fds == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < other_fds; ++i) {
+    fds[i] = ufs_open("other", UFS_CREATE);
+  }
+  double start = now_sec();
+  for (int i = 0; i < rounds; ++i) {
+    ufs_resize(fd, 4096);
+    ufs_resize(fd, 100);
+  }
+  double sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "resize", other_fds,
+         2 * rounds, sec, 2 * rounds / sec);
+  for (int i = 0; i < other_fds; ++i) {
+    ufs_close(fds[i]);
+  }
+  ufs_close(fd);
+  ufs_delete("other");
+  ufs_delete("bench");
+  free(fds);
+}
+
+static void
+bench_open_close(int files)
+{
+  char name[32];
+  double start = now_sec();
+  for (int i = 0; i < files; ++i) {
+    sprintf(name, "file%d", i);
+    ufs_close(ufs_open(name, UFS_CREATE));
+  }
+  double sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "create", files, files,
+         sec, files / sec);
+  start = now_sec();
+  for (int i = 0; i < files; ++i) {
+    sprintf(name, "file%d", i);
+    ufs_close(ufs_open(name, 0));
+  }
+  sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "open_close", files, files,
+         sec, files / sec);
+  start = now_sec();
+  for (int i = 0; i < files; ++i) {
+    sprintf(name, "file%d", i);
+    ufs_delete(name);
+  }
+  sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "delete", files, files,
+         sec, files / sec);
+}
+
+/**
+ * Opens a file 16 directories deep many times, then lists one
+ * directory of @a dirs with @a files each.
+ */
+static void
+bench_dirs(int dirs, int files, int rounds)
+{
+  char name[256];
+  int len = 0;
+  for (int i = 0; i < 16; ++i) {
+    len += sprintf(name + len, "%sdeep%d", i == 0 ? "" : "/", i);
+    ufs_mkdir(name);
+  }
+  strcpy(name + len, "/file");
+  ufs_close(ufs_open(name, UFS_CREATE));
+  double start = now_sec();
+  for (int i = 0; i < rounds; ++i) {
+    ufs_close(ufs_open(name, 0));
+  }
+  double sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "deep_open", 16, rounds,
+         sec, rounds / sec);
+  ufs_delete(name);
+  for (int i = 15; i >= 0; --i) {
+    name[len] = 0;
+    ufs_delete(name);
+    len = strrchr(name, '/') == NULL ? 0 : strrchr(name, '/') - name;
+  }
+
+  for (int i = 0; i < dirs; ++i) {
+    sprintf(name, "dir%d", i);
+    ufs_mkdir(name);
+    for (int j = 0; j < files; ++j) {
+      sprintf(name, "dir%d/file%d", i, j);
+      ufs_close(ufs_open(name, UFS_CREATE));
+    }
+  }
+  start = now_sec();
+  int listed = 0;
+  for (int i = 0; i < rounds / files; ++i) {
+    struct ufs_dir *dir = ufs_opendir("dir0");
+    while (ufs_readdir(dir) != NULL) {
+      ++listed;
+    }
+    ufs_closedir(dir);
+  }
+  sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "readdir", files, listed,
+         sec, listed / sec);
+  for (int i = 0; i < dirs; ++i) {
+    for (int j = 0; j < files; ++j) {
+      sprintf(name, "dir%d/file%d", i, j);
+      ufs_delete(name);
+    }
+    sprintf(name, "dir%d", i);
+    ufs_delete(name);
+  }
+}
+
+static void
+bench_descriptors(int open_fds, int rounds)
+{
+  int *fds = malloc(open_fds * sizeof(int));
+  if (fds == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < open_fds; ++i) {
+    fds[i] = ufs_open("bench", UFS_CREATE);
+  }
+  double start = now_sec();
+  for (int i = 0; i < rounds; ++i) {
+    int j = i % open_fds;
+    ufs_close(fds[j]);
+    fds[j] = ufs_open("bench", 0);
+    ufs_write(fds[open_fds - 1], "data", 4);
+  }
+  double sec = now_sec() - start;
+  printf("%-12s %10d %12d %10.3f %10.0f ops/s\n", "descriptors", open_fds,
+         rounds, sec, rounds / sec);
+  for (int i = 0; i < open_fds; ++i) {
+    ufs_close(fds[i]);
+  }
+  ufs_delete("bench");
+  free(fds);
+}
+
+enum {
+  THREAD_FILE_SIZE = 64 * 1024 * 1024,
+  THREAD_ROUNDS = 8,
+};
+
+struct reader_arg {
+  const char *name;
+  size_t bytes;
+};
+
+static void *
+reader_thread(void *p)
+{
+  struct reader_arg *arg = p;
+  char *buf = malloc(64 * 1024);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < THREAD_ROUNDS; ++i) {
+    int fd = ufs_open(arg->name, 0);
+    ssize_t rc;
+    while ((rc = ufs_read(fd, buf, 64 * 1024)) > 0) {
+      arg->bytes += rc;
+    }
+    ufs_close(fd);
+  }
+  free(buf);
+  return NULL;
+}
+
+static void
+bench_threads(int max_threads, bool shared)
+{
+  static const char *names[] = {"t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+    "t8", "t9", "t10", "t11", "t12", "t13", "t14", "t15"};
+  char *buf = malloc(THREAD_FILE_SIZE);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 'x', THREAD_FILE_SIZE);
+  int files = shared ? 1 : max_threads;
+  for (int i = 0; i < files; ++i) {
+    int fd = ufs_open(names[i], UFS_CREATE);
+    ufs_write(fd, buf, THREAD_FILE_SIZE);
+    ufs_close(fd);
+  }
+  free(buf);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    pthread_t tids[16];
+    struct reader_arg args[16];
+    double start = now_sec();
+    for (int i = 0; i < threads; ++i) {
+      args[i].name = names[shared ? 0 : i];
+      args[i].bytes = 0;
+      pthread_create(&tids[i], NULL, reader_thread, &args[i]);
+    }
+    size_t bytes = 0;
+    for (int i = 0; i < threads; ++i) {
+      pthread_join(tids[i], NULL);
+      bytes += args[i].bytes;
+    }
+    report(shared ? "mt_shared" : "mt_private", threads, bytes, now_sec() - start);
+  }
+  for (int i = 0; i < files; ++i) {
+    ufs_delete(names[i]);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t file_size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024) * 1024 * 1024;
+  static const size_t chunks[] = {4096, 64 * 1024, 1024 * 1024};
+  printf("%-12s %10s %12s %10s %10s\n", "case", "chunk", "bytes", "seconds",
+         "MiB/s");
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    bench_sequential(file_size, chunks[i]);
+  }
+  static const size_t block_sizes[] = {4096, 64 * 1024, 2 * 1024 * 1024};
+  for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); ++i) {
+    bench_block_size(file_size, block_sizes[i]);
+  }
+  bench_sparse_copy(file_size);
+  bench_random(16 * 1024 * 1024, 4096, 1000000);
+  bench_random(file_size, 4096, 1000000);
+  bench_image(file_size);
+  bench_clone(file_size);
+  bench_resize(10000, 100000);
+  bench_open_close(100000);
+  bench_dirs(100, 1000, 100000);
+  bench_descriptors(10000, 100000);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = cpus < 4 ? 4 : (cpus > 16 ? 16 : cpus);
+  bench_threads(max_threads, false);
+  bench_threads(max_threads, true);
+  return 0;
+}
@@ -1,7 +1,10 @@
 #include "userfs.h"
 #include "unit.h"
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -314,6 +317,853 @@ test_resize(void)
 #endif
 }
 
+static void
+test_block_boundaries(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  const int size = 200 * 1024 + 17;
+  char *buf = (char *) malloc(size);
+  char *buf2 = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 23;
+  for (int done = 0; done < size;) {
+    int chunk = size - done < 1000 ? size - done : 1000;
+    unit_fail_if(ufs_write(fd, buf + done, chunk) != chunk);
+    done += chunk;
+  }
+  int fd2 = ufs_open("file", 0);
+  unit_fail_if(fd2 == -1);
+  int done = 0;
+  ssize_t rc;
+  while ((rc = ufs_read(fd2, buf2 + done, 4093)) > 0)
+    done += rc;
+  unit_check(done == size, "odd-sized writes and reads cross blocks");
+  unit_check(memcmp(buf, buf2, size) == 0, "data is correct");
+
+#ifdef NEED_RESIZE
+  unit_fail_if(ufs_resize(fd, 100) != 0);
+  unit_fail_if(ufs_resize(fd, size) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  fd2 = ufs_open("file", 0);
+  unit_check(ufs_read(fd2, buf2, size) == size, "grown file has its size");
+  int zeros = 0;
+  for (int i = 100; i < size; ++i)
+    zeros += buf2[i] == 0;
+  unit_check(memcmp(buf, buf2, 100) == 0 && zeros == size - 100,
+       "the kept part survives, the grown part reads as zeros");
+#endif
+
+  free(buf2);
+  free(buf);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_many_files(void)
+{
+  unit_test_start();
+
+  const int count = 10000;
+  char name[32];
+  for (int i = 0; i < count; ++i) {
+    sprintf(name, "file%d", i);
+    int fd = ufs_open(name, UFS_CREATE);
+    unit_fail_if(fd == -1);
+    unit_fail_if(ufs_close(fd) != 0);
+  }
+  for (int i = 0; i < count; i += 2) {
+    sprintf(name, "file%d", i);
+    unit_fail_if(ufs_delete(name) != 0);
+  }
+  bool ok = true;
+  for (int i = 0; i < count; ++i) {
+    sprintf(name, "file%d", i);
+    int fd = ufs_open(name, 0);
+    ok = ok && (fd == -1) == (i % 2 == 0);
+    if (fd != -1)
+      unit_fail_if(ufs_close(fd) != 0);
+  }
+  unit_check(ok, "only the remaining files are found by name");
+  for (int i = 1; i < count; i += 2) {
+    sprintf(name, "file%d", i);
+    unit_fail_if(ufs_delete(name) != 0);
+  }
+  unit_check(ufs_delete("file1") == -1, "all files are deleted");
+
+  unit_test_finish();
+}
+
+static void
+test_lowest_fd(void)
+{
+  unit_test_start();
+
+  const int count = 3000;
+  static int fd[3000];
+  for (int i = 0; i < count; ++i) {
+    fd[i] = ufs_open("file", UFS_CREATE);
+    unit_fail_if(fd[i] == -1);
+  }
+  unit_fail_if(ufs_close(fd[2500]) != 0);
+  unit_fail_if(ufs_close(fd[1200]) != 0);
+  int fd1 = ufs_open("file", 0);
+  int fd2 = ufs_open("file", 0);
+  unit_check(fd1 == fd[1200] && fd2 == fd[2500],
+       "the lowest free descriptors are reused first");
+  fd[1200] = fd1;
+  fd[2500] = fd2;
+  unit_check(ufs_write(fd[count - 1], "x", 1) == 1,
+       "the highest descriptor works");
+  for (int i = 0; i < count; ++i)
+    unit_fail_if(ufs_close(fd[i]) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void *
+thread_worker(void *arg)
+{
+  int id = *(int *) arg;
+  char name[16], buf[1000], buf2[1000];
+  sprintf(name, "thread%d", id);
+  memset(buf, 'a' + id, sizeof(buf));
+  bool ok = true;
+  int fd = ufs_open(name, UFS_CREATE);
+  for (int i = 0; i < 1000; ++i)
+    ok = ok && ufs_write(fd, buf, sizeof(buf)) == sizeof(buf);
+  int fd2 = ufs_open(name, 0);
+  for (int i = 0; i < 1000; ++i) {
+    ok = ok && ufs_read(fd2, buf2, sizeof(buf2)) == sizeof(buf2);
+    ok = ok && memcmp(buf, buf2, sizeof(buf)) == 0;
+  }
+  for (int i = 0; i < 1000; ++i) {
+    int shared = ufs_open("shared", UFS_CREATE);
+    ok = ok && shared != -1 && ufs_write(shared, buf, 10) == 10;
+    ok = ok && ufs_close(shared) == 0;
+  }
+  ok = ok && ufs_close(-1) == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+  ok = ok && ufs_close(fd) == 0 && ufs_close(fd2) == 0;
+  ok = ok && ufs_delete(name) == 0;
+  return ok ? arg : NULL;
+}
+
+static void
+test_threads(void)
+{
+  unit_test_start();
+
+  enum { THREADS = 8 };
+  pthread_t tids[THREADS];
+  int ids[THREADS];
+  for (int i = 0; i < THREADS; ++i) {
+    ids[i] = i;
+    unit_fail_if(pthread_create(&tids[i], NULL, thread_worker, &ids[i]) != 0);
+  }
+  bool ok = true;
+  for (int i = 0; i < THREADS; ++i) {
+    void *res;
+    pthread_join(tids[i], &res);
+    ok = ok && res != NULL;
+  }
+  unit_check(ok, "threads write, read and reopen files concurrently");
+  int fd = ufs_open("shared", 0);
+  char buf[16];
+  int size = 0;
+  ssize_t rc;
+  while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0)
+    size += rc;
+  unit_check(size == 10, "writes of all threads went through the shared file");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("shared") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_pread_pwrite(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  const int size = 150 * 1024;
+  char *buf = (char *) malloc(size);
+  char *buf2 = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 19;
+  unit_check(ufs_pwrite(fd, buf, size, 1000) == size, "pwrite past the end");
+  unit_check(ufs_pread(fd, buf2, size, 0) == size, "pread from the start");
+  int zeros = 0;
+  for (int i = 0; i < 1000; ++i)
+    zeros += buf2[i] == 0;
+  unit_check(zeros == 1000, "the gap before the write reads as zeros");
+  unit_check(ufs_pread(fd, buf2, size, 1000) == size &&
+       memcmp(buf, buf2, size) == 0, "data crosses blocks correctly");
+  unit_check(ufs_pread(fd, buf2, size, size + 1000) == 0, "pread at the end");
+  unit_check(ufs_pread(fd, buf2, 10, size + 5000) == 0, "pread past the end");
+  unit_check(ufs_read(fd, buf2, 10) == 10 && buf2[0] == 0,
+       "the cursor did not move");
+
+  int ro = ufs_open("file", UFS_READ_ONLY);
+  unit_check(ufs_pwrite(ro, buf, 10, 0) == -1 &&
+       ufs_errno() == UFS_ERR_NO_PERMISSION, "pwrite needs write rights");
+  unit_check(ufs_pread(ro + 100, buf2, 10, 0) == -1 &&
+       ufs_errno() == UFS_ERR_NO_FILE, "pread checks the descriptor");
+
+  free(buf2);
+  free(buf);
+  unit_fail_if(ufs_close(ro) != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_vectored(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  static char big[100 * 1024];
+  memset(big, 'x', sizeof(big));
+  struct iovec out[3] = {
+    {"head", 4}, {big, sizeof(big)}, {"tail", 4},
+  };
+  ssize_t total = 8 + sizeof(big);
+  unit_check(ufs_writev(fd, out, 3) == total, "writev of three buffers");
+
+  int fd2 = ufs_open("file", 0);
+  char head[4], tail[10];
+  static char big2[100 * 1024];
+  struct iovec in[3] = {
+    {head, sizeof(head)}, {big2, sizeof(big2)}, {tail, sizeof(tail)},
+  };
+  unit_check(ufs_readv(fd2, in, 3) == total, "readv stops at the end");
+  unit_check(memcmp(head, "head", 4) == 0 && memcmp(tail, "tail", 4) == 0 &&
+       memcmp(big, big2, sizeof(big)) == 0, "buffers are filled in order");
+  unit_check(ufs_readv(fd2, in, 3) == 0, "then it returns EOF");
+
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+  unit_test_start();
+
+  struct ufs_stats before, after;
+  ufs_get_stats(&before);
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  static char buf[3 * 64 * 1024];
+  unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+  ufs_get_stats(&after);
+  size_t blocks = sizeof(buf) / (64 * 1024);
+  unit_check(after.blocks_used == before.blocks_used + blocks,
+       "blocks of the file are counted");
+  unit_check(after.files == before.files + 1, "the file is counted");
+  unit_check(after.mapped_bytes >= after.block_bytes &&
+       after.block_bytes >= after.blocks_used * 4096,
+       "blocks are mapped");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  ufs_get_stats(&before);
+  unit_check(before.blocks_used == after.blocks_used - blocks &&
+       before.blocks_free >= blocks, "blocks of a deleted file are free");
+  fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+  ufs_get_stats(&after);
+  unit_check(after.mapped_bytes == before.mapped_bytes,
+       "a new file reuses them");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  const int size = 150 * 1024;
+  char *buf = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 21;
+  unit_fail_if(ufs_write(fd, buf, size) != size);
+
+  int fd2 = ufs_open("file", 0);
+  struct ufs_view view;
+  int done = 0;
+  bool same = true;
+  ssize_t rc;
+  while ((rc = ufs_read_view(fd2, &view)) > 0) {
+    same = same && memcmp(view.data, buf + done, rc) == 0;
+    done += rc;
+    ufs_release_view(&view);
+  }
+  unit_check(rc == 0 && done == size && same, "views scan the whole file");
+  unit_check(ufs_pread_view(fd2, &view, 70000) > 0 &&
+       memcmp(view.data, buf + 70000, view.size) == 0,
+       "a view at an offset");
+  ufs_release_view(&view);
+  unit_check(ufs_pread_view(fd2, &view, size) == 0, "no view past the end");
+  unit_check(ufs_lseek(fd2, 0, UFS_SEEK_CUR) == size,
+       "the position does not move");
+
+  unit_fail_if(ufs_close(fd2) != 0);
+  fd2 = ufs_open("file", 0);
+  unit_fail_if(ufs_read_view(fd2, &view) <= 0);
+  unit_fail_if(ufs_pwrite(fd, "zzz", 3, 0) != 3);
+  char head[3];
+  unit_check(ufs_pread(fd, head, 3, 0) == 3 && memcmp(head, "zzz", 3) == 0,
+       "the file sees a write");
+  unit_check(memcmp(view.data, buf, 3) == 0, "an earlier view does not");
+
+  unit_fail_if(ufs_resize(fd, 0) != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  unit_check(memcmp(view.data, buf, view.size) == 0,
+       "a view survives truncation and deletion");
+  struct ufs_stats held, after;
+  ufs_get_stats(&held);
+  ufs_release_view(&view);
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == held.blocks_used - 1,
+       "release frees the block kept by the view");
+  unit_check(ufs_read_view(fd, &view) == -1 &&
+       ufs_errno() == UFS_ERR_NO_FILE, "view of a closed descriptor");
+  ufs_release_view(&view);
+
+  free(buf);
+  unit_test_finish();
+}
+
+static void
+test_block_size(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  unit_check(ufs_set_block_size(fd, 3000) == -1 &&
+       ufs_errno() == UFS_ERR_INVALID_ARG, "block size is a power of two");
+  unit_check(ufs_set_block_size(fd, 4 * 1024 * 1024) == -1 &&
+       ufs_errno() == UFS_ERR_INVALID_ARG, "at most 2 MiB");
+  unit_check(ufs_set_block_size(fd, 2048) == -1, "at least 4 KiB");
+
+  const int size = 5 * 1024 * 1024 + 123;
+  char *buf = (char *) malloc(size);
+  char *buf2 = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 17;
+  static const size_t sizes[] = {4096, 2 * 1024 * 1024};
+  for (int k = 0; k < 2; ++k) {
+    unit_fail_if(ufs_set_block_size(fd, sizes[k]) != 0);
+    unit_fail_if(ufs_pwrite(fd, buf, size, 0) != size);
+    unit_check(ufs_pread(fd, buf2, size, 0) == size &&
+         memcmp(buf, buf2, size) == 0, "data crosses blocks of any size");
+    unit_check(ufs_set_block_size(fd, 8192) == -1 &&
+         ufs_errno() == UFS_ERR_INVALID_ARG, "only an empty file is changed");
+    unit_fail_if(ufs_resize(fd, 0) != 0);
+  }
+
+  free(buf2);
+  free(buf);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  struct ufs_stats before, after;
+  ufs_get_stats(&before);
+  const size_t size = 512 * 1024 * 1024;
+  unit_fail_if(ufs_resize(fd, size) != 0);
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == before.blocks_used,
+       "resize allocates no blocks");
+
+  char buf[100];
+  memset(buf, 'x', sizeof(buf));
+  unit_check(ufs_pread(fd, buf, sizeof(buf), size / 2) == sizeof(buf) &&
+       buf[0] == 0 && buf[99] == 0, "a hole reads as zeros");
+  unit_fail_if(ufs_pwrite(fd, "data", 4, size / 2 + 10) != 4);
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == before.blocks_used + 1,
+       "a write allocates one block");
+  unit_check(ufs_pread(fd, buf, sizeof(buf), size / 2) == sizeof(buf) &&
+       buf[9] == 0 && memcmp(buf + 10, "data", 4) == 0 && buf[14] == 0,
+       "bytes around the write are zeros");
+  unit_fail_if(ufs_pwrite(fd, "end", 3, size + 1000) != 3);
+  unit_check(ufs_pread(fd, buf, 3, size + 500) == 3 && buf[0] == 0,
+       "a gap left by a write past the end reads as zeros");
+
+  unit_check(ufs_resize(fd, 2 * size + size) == -1 &&
+       ufs_errno() == UFS_ERR_NO_MEM, "the default limit is 1 GiB");
+  ufs_set_max_file_size(8ULL * 1024 * 1024 * 1024);
+  const size_t big = 6ULL * 1024 * 1024 * 1024;
+  unit_check(ufs_resize(fd, big) == 0, "a raised limit allows bigger files");
+  unit_check(ufs_pwrite(fd, "far", 3, big - 3) == 3 &&
+       ufs_pread(fd, buf, 3, big - 3) == 3 && memcmp(buf, "far", 3) == 0,
+       "offsets past 4 GiB work");
+  ufs_set_max_file_size(1024 * 1024 * 1024);
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void
+test_seek(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(fd == -1);
+  unit_fail_if(ufs_set_block_size(fd, 4096) != 0);
+  unit_check(ufs_lseek(fd, 0, UFS_SEEK_DATA) == -1 &&
+       ufs_errno() == UFS_ERR_INVALID_ARG, "an empty file has no data");
+  unit_fail_if(ufs_resize(fd, 100000) != 0);
+  unit_fail_if(ufs_pwrite(fd, "a", 1, 10000) != 1);
+  unit_fail_if(ufs_pwrite(fd, "b", 1, 50000) != 1);
+
+  unit_check(ufs_lseek(fd, 0, UFS_SEEK_DATA) == 8192,
+       "data starts at the block of the first write");
+  unit_check(ufs_lseek(fd, 9000, UFS_SEEK_DATA) == 9000,
+       "an offset in data is data");
+  unit_check(ufs_lseek(fd, 9000, UFS_SEEK_HOLE) == 12288,
+       "the hole after it starts at the next block");
+  unit_check(ufs_lseek(fd, 12288, UFS_SEEK_DATA) == 49152, "second data");
+  unit_check(ufs_lseek(fd, 49152, UFS_SEEK_HOLE) == 53248, "second hole");
+  unit_check(ufs_lseek(fd, 53248, UFS_SEEK_DATA) == -1,
+       "no data after the last hole");
+  unit_check(ufs_lseek(fd, 100000, UFS_SEEK_HOLE) == -1,
+       "the end is not in the file");
+
+  unit_fail_if(ufs_pwrite(fd, "c", 1, 99999) != 1);
+  unit_check(ufs_lseek(fd, 99000, UFS_SEEK_HOLE) == 100000,
+       "the end of the file is a hole");
+  unit_check(ufs_lseek(fd, 0, UFS_SEEK_SET) == 0, "seek set");
+  unit_check(ufs_lseek(fd, 10, UFS_SEEK_CUR) == 10, "seek cur");
+  unit_check(ufs_lseek(fd, -1, UFS_SEEK_END) == 99999, "seek end");
+  char c;
+  unit_check(ufs_read(fd, &c, 1) == 1 && c == 'c', "read at the position");
+  unit_check(ufs_pseek(fd, 0, UFS_SEEK_DATA) == 8192 &&
+       ufs_pseek(fd, 0, UFS_SEEK_END) == 100000 &&
+       ufs_lseek(fd, 0, UFS_SEEK_CUR) == 100000,
+       "pseek leaves the position");
+  unit_check(ufs_pseek(fd, 53248, UFS_SEEK_DATA) == 98304 &&
+       ufs_lseek(fd, 0, UFS_SEEK_CUR) == 100000, "pseek finds data");
+  unit_check(ufs_lseek(fd, -200000, UFS_SEEK_CUR) == -1 &&
+       ufs_errno() == UFS_ERR_INVALID_ARG, "negative position");
+  unit_check(ufs_read(fd, &c, 1) == 0, "the position stays after an error");
+  unit_check(ufs_lseek(fd, 9999, UFS_SEEK_SET) == 9999 &&
+       ufs_read(fd, &c, 1) == 1 && c == 0 && ufs_read(fd, &c, 1) == 1 &&
+       c == 'a', "a hole and data are read in a row");
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  unit_test_finish();
+}
+
+static void *
+sync_worker(void *arg)
+{
+  return ufs_sync() == 0 ? arg : NULL;
+}
+
+static void
+test_persistence(void)
+{
+  unit_test_start();
+
+  const char *path = "test_image.ufs";
+  unlink(path);
+  unit_check(ufs_sync() == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+       "sync needs an image");
+  unit_check(ufs_mount(path) == 0, "mount a missing image");
+
+  const int size = 300 * 1024;
+  char *buf = (char *) malloc(size);
+  char *buf2 = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 13;
+  int fd = ufs_open("file", UFS_CREATE);
+  unit_fail_if(ufs_set_block_size(fd, 4096) != 0);
+  unit_fail_if(ufs_write(fd, buf, size) != size);
+  unit_fail_if(ufs_resize(fd, 10 * size) != 0);
+  unit_fail_if(ufs_pwrite(fd, "tail", 4, 10 * size - 4) != 4);
+  int fd2 = ufs_open("empty", UFS_CREATE);
+  unit_check(ufs_mount(path) == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+       "mount needs no files");
+  unit_check(ufs_sync() == 0, "sync");
+  enum { SYNC_THREADS = 4 };
+  pthread_t tids[SYNC_THREADS];
+  for (int i = 0; i < SYNC_THREADS; ++i)
+    unit_fail_if(pthread_create(&tids[i], NULL, sync_worker, buf) != 0);
+  bool synced = true;
+  for (int i = 0; i < SYNC_THREADS; ++i) {
+    void *res;
+    pthread_join(tids[i], &res);
+    synced = synced && res != NULL;
+  }
+  unit_check(synced, "concurrent syncs");
+  unit_fail_if(ufs_pwrite(fd, "zz", 2, 0) != 2);
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  unit_fail_if(ufs_delete("empty") != 0);
+  unit_check(ufs_mount(path) == 0, "mount the image back");
+
+  fd = ufs_open("file", 0);
+  fd2 = ufs_open("empty", 0);
+  unit_check(fd != -1 && fd2 != -1, "files are back");
+  unit_check(ufs_read(fd2, buf2, 1) == 0, "an empty file stays empty");
+  unit_check(ufs_read(fd, buf2, size) == size && memcmp(buf, buf2, size) == 0,
+       "data is the synced one");
+  unit_check(ufs_lseek(fd, size, UFS_SEEK_DATA) == 10 * size - 4096,
+       "holes stay holes");
+  unit_check(ufs_pread(fd, buf2, 4, 10 * size - 4) == 4 &&
+       memcmp(buf2, "tail", 4) == 0, "the last block is back");
+  unit_fail_if(ufs_pwrite(fd, "new", 3, 0) != 3);
+  unit_check(ufs_pread(fd, buf2, 3, 0) == 3 && memcmp(buf2, "new", 3) == 0,
+       "a loaded file can be written");
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  unit_fail_if(ufs_delete("empty") != 0);
+  unit_check(ufs_mount(path) == 0, "mount once more");
+  fd = ufs_open("file", 0);
+  unit_check(ufs_pread(fd, buf2, 3, 0) == 3 && memcmp(buf2, buf, 3) == 0,
+       "writes after sync do not reach the image");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  unit_fail_if(ufs_delete("empty") != 0);
+
+  memset(buf2, 'S', 4096);
+  fd = ufs_open("secret", UFS_CREATE);
+  unit_fail_if(ufs_set_block_size(fd, 4096) != 0);
+  unit_fail_if(ufs_write(fd, buf2, 4096) != 4096);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("secret") != 0);
+  fd = ufs_open("short", UFS_CREATE);
+  unit_fail_if(ufs_set_block_size(fd, 4096) != 0);
+  unit_fail_if(ufs_write(fd, buf2, 4096) != 4096);
+  unit_fail_if(ufs_resize(fd, 3) != 0);
+  fd2 = ufs_open("reused", UFS_CREATE);
+  unit_fail_if(ufs_set_block_size(fd2, 4096) != 0);
+  unit_fail_if(ufs_write(fd2, "abc", 3) != 3);
+  unit_fail_if(ufs_sync() != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_delete("short") != 0);
+  unit_fail_if(ufs_delete("reused") != 0);
+  FILE *f = fopen(path, "r");
+  size_t image_len = fread(buf, 1, size, f);
+  fclose(f);
+  bool leaked = false;
+  for (size_t i = 0; i + 64 <= image_len && !leaked; ++i)
+    leaked = memcmp(buf + i, buf2, 64) == 0;
+  unit_check(!leaked, "bytes past the size are not written to the image");
+
+  char broken[16] = {0};
+  f = fopen(path, "r+");
+  fseek(f, 4096, SEEK_SET);
+  fwrite(broken, 1, sizeof(broken), f);
+  fclose(f);
+  unit_check(ufs_mount(path) == -1 && ufs_errno() == UFS_ERR_IO,
+       "a damaged block header is refused");
+
+  f = fopen(path, "r+");
+  fputs("garbage", f);
+  fclose(f);
+  unit_check(ufs_mount(path) == -1 && ufs_errno() == UFS_ERR_IO,
+       "a damaged image is refused");
+  unit_check(ufs_open("file", 0) == -1, "and nothing is loaded");
+  unlink(path);
+  unit_check(ufs_mount(".") == -1 && ufs_errno() == UFS_ERR_IO,
+       "a directory is not an image");
+  unit_check(ufs_mount("test.c/image") == -1 && ufs_errno() == UFS_ERR_IO,
+       "only a missing image is created");
+
+  unit_fail_if(ufs_mount(path) != 0);
+  fd = ufs_open("empty", UFS_CREATE);
+  unit_fail_if(ufs_sync() != 0);
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("empty") != 0);
+  /* The superblock stores the offset of the inode table at 24. */
+  uint64_t inode_offset, huge_size = UINT64_MAX;
+  f = fopen(path, "r+");
+  fseek(f, 24, SEEK_SET);
+  unit_fail_if(fread(&inode_offset, sizeof(inode_offset), 1, f) != 1);
+  fseek(f, inode_offset, SEEK_SET);
+  fwrite(&huge_size, sizeof(huge_size), 1, f);
+  fclose(f);
+  unit_check(ufs_mount(path) == -1 && ufs_errno() == UFS_ERR_IO,
+       "a file size over the limit is refused");
+  unlink(path);
+
+  free(buf2);
+  free(buf);
+  unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+  unit_test_start();
+
+  unit_check(ufs_clone("file", "copy") == -1 &&
+       ufs_errno() == UFS_ERR_NO_FILE, "clone of a missing file");
+  int fd = ufs_open("file", UFS_CREATE);
+  const int size = 4 * 64 * 1024;
+  char *buf = (char *) malloc(size);
+  char *buf2 = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    buf[i] = 'a' + i % 11;
+  unit_fail_if(ufs_write(fd, buf, size) != size);
+  unit_fail_if(ufs_resize(fd, 2 * size) != 0);
+
+  struct ufs_stats before, after;
+  ufs_get_stats(&before);
+  unit_check(ufs_clone("file", "copy") == 0, "clone");
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == before.blocks_used,
+       "the clone shares all blocks");
+  int fd2 = ufs_open("copy", 0);
+  unit_check(ufs_read(fd2, buf2, size) == size && memcmp(buf, buf2, size) == 0,
+       "the clone has the data");
+  unit_check(ufs_lseek(fd2, 0, UFS_SEEK_END) == 2 * size &&
+       ufs_lseek(fd2, size, UFS_SEEK_DATA) == -1, "and the holes");
+
+  unit_fail_if(ufs_pwrite(fd2, "xy", 2, 10) != 2);
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == before.blocks_used + 1,
+       "a write copies one block");
+  unit_check(ufs_pread(fd, buf2, size, 0) == size && memcmp(buf, buf2, size) == 0,
+       "the source does not change");
+  unit_fail_if(ufs_pwrite(fd, "z", 1, 70000) != 1);
+  unit_check(ufs_pread(fd2, buf2, 1, 70000) == 1 && buf2[0] == buf[70000],
+       "nor the clone when the source is written");
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  unit_check(ufs_pread(fd2, buf2, size, 0) == size &&
+       memcmp(buf2 + 12, buf + 12, size - 12) == 0 &&
+       memcmp(buf2 + 10, "xy", 2) == 0, "the clone outlives the source");
+  fd = ufs_open("other", UFS_CREATE);
+  unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+  unit_check(ufs_clone("other", "copy") == 0 &&
+       ufs_pread(fd2, buf2, size, 0) == 3, "clone over an opened file");
+  unit_check(ufs_read(fd2, buf2, 1) == 0, "its descriptor is at the new end");
+
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(fd2) != 0);
+  unit_fail_if(ufs_delete("copy") != 0);
+  unit_fail_if(ufs_delete("other") != 0);
+  ufs_get_stats(&after);
+  unit_check(after.blocks_used == before.blocks_used - 4,
+       "all blocks are freed");
+
+  free(buf2);
+  free(buf);
+  unit_test_finish();
+}
+
+static int
+list_dir(const char *path, char *out)
+{
+  struct ufs_dir *dir = ufs_opendir(path);
+  if (dir == NULL)
+    return -1;
+  int count = 0;
+  const char *name;
+  out[0] = 0;
+  while ((name = ufs_readdir(dir)) != NULL) {
+    strcat(out, name);
+    strcat(out, ";");
+    ++count;
+  }
+  ufs_closedir(dir);
+  return count;
+}
+
+static void
+test_dirs(void)
+{
+  unit_test_start();
+
+  char list[256];
+  const char *path = "test_image.ufs";
+  unlink(path);
+  unit_fail_if(ufs_mount(path) != 0);
+  unit_check(ufs_open("d/file", UFS_CREATE) == -1 &&
+       ufs_errno() == UFS_ERR_NO_FILE, "no file without its directory");
+  unit_check(ufs_mkdir("d/e") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+       "no directory without its parent");
+  unit_check(ufs_mkdir("d") == 0 && ufs_mkdir("d/e") == 0, "mkdir");
+  unit_check(ufs_mkdir("d") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+       "mkdir of an existing one");
+  unit_check(ufs_open("d", UFS_CREATE) == -1 &&
+       ufs_errno() == UFS_ERR_IS_DIR, "a directory is not opened as a file");
+
+  int fd = ufs_open("d/e/file", UFS_CREATE);
+  unit_check(fd != -1 && ufs_write(fd, "deep", 4) == 4, "a file in a directory");
+  unit_fail_if(ufs_close(fd) != 0);
+  fd = ufs_open("d/e/file", 0);
+  unit_check(ufs_read(fd, list, 4) == 4 && memcmp(list, "deep", 4) == 0,
+       "it is found by its path");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_close(ufs_open("d/file", UFS_CREATE)) != 0);
+  unit_fail_if(ufs_close(ufs_open("top", UFS_CREATE)) != 0);
+  unit_check(ufs_open("e/file", 0) == -1, "paths start at the root");
+
+  unit_check(list_dir("d/e", list) == 1 && strcmp(list, "file;") == 0,
+       "readdir of a nested directory");
+  unit_check(list_dir("d", list) == 2 &&
+       (strcmp(list, "file;e;") == 0 || strcmp(list, "e;file;") == 0),
+       "readdir lists only the files of the directory");
+  unit_check(list_dir("/", list) == 2, "readdir of the root");
+  unit_check(ufs_opendir("x") == NULL && ufs_errno() == UFS_ERR_NO_FILE,
+       "opendir of a missing directory");
+  unit_check(ufs_opendir("top") == NULL && ufs_errno() == UFS_ERR_NOT_DIR,
+       "opendir of a file");
+  fd = ufs_open("/d/e/file", 0);
+  unit_check(fd != -1 && ufs_close(fd) == 0 && list_dir("/d", list) == 2,
+       "a leading slash starts at the root");
+  unit_check(ufs_mkdir("/d/f") == 0 && list_dir("d/f", list) == 0 &&
+       ufs_delete("/d/f") == 0, "in every call");
+
+  unit_check(ufs_delete("d/e") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+       "a directory with files is not deleted");
+
+  unit_fail_if(ufs_sync() != 0);
+  unit_fail_if(ufs_delete("d/e/file") != 0);
+  unit_check(ufs_delete("d/e") == 0, "an empty directory is deleted");
+  unit_check(list_dir("d", list) == 1 && strcmp(list, "file;") == 0,
+       "and is gone from its parent");
+  unit_fail_if(ufs_delete("d/file") != 0);
+  unit_fail_if(ufs_delete("d") != 0);
+  unit_fail_if(ufs_delete("top") != 0);
+  unit_check(list_dir("", list) == 0, "the root is empty");
+
+  unit_check(ufs_mount(path) == 0 && list_dir("d/e", list) == 1 &&
+       list_dir("", list) == 2, "directories are saved in the image");
+  fd = ufs_open("d/e/file", 0);
+  unit_check(ufs_read(fd, list, 4) == 4 && memcmp(list, "deep", 4) == 0,
+       "with their files");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("d/e/file") != 0);
+  unit_fail_if(ufs_delete("d/e") != 0);
+  unit_fail_if(ufs_delete("d/file") != 0);
+  unit_fail_if(ufs_delete("d") != 0);
+  unit_fail_if(ufs_delete("top") != 0);
+  unlink(path);
+
+  unit_test_finish();
+}
+
+static void
+test_append(void)
+{
+  unit_test_start();
+
+  int fd = ufs_open("file", UFS_CREATE | UFS_APPEND);
+  unit_fail_if(fd == -1);
+  unit_fail_if(ufs_set_block_size(fd, 4096) != 0);
+  unit_fail_if(ufs_write(fd, "head", 4) != 4);
+  unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+  unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+  char buf[8];
+  unit_check(ufs_lseek(fd, 0, UFS_SEEK_CUR) == 8,
+       "an append moves the position to the end");
+  unit_check(ufs_pread(fd, buf, 8, 0) == 8 && memcmp(buf, "headtail", 8) == 0,
+       "an append ignores the position");
+  unit_fail_if(ufs_pwrite(fd, "H", 1, 0) != 1);
+  unit_check(ufs_pread(fd, buf, 8, 0) == 8 && memcmp(buf, "Headtail", 8) == 0,
+       "pwrite writes at its offset");
+
+  int other = ufs_open("file", UFS_WRITE_ONLY);
+  unit_fail_if(other == -1);
+  unit_fail_if(ufs_write(other, "xx", 2) != 2);
+  unit_fail_if(ufs_write(fd, "!", 1) != 1);
+  unit_check(ufs_pread(fd, buf, 8, 0) == 8 && memcmp(buf, "xxadtail", 8) == 0 &&
+       ufs_pread(fd, buf, 2, 7) == 2 && memcmp(buf, "l!", 2) == 0,
+       "descriptors without the flag write at their position");
+  unit_fail_if(ufs_close(other) != 0);
+
+  /* More blocks than one batch, starting inside a block. */
+  const int size = 1024 * 1024 + 123;
+  char *data = (char *) malloc(size);
+  char *back = (char *) malloc(size);
+  for (int i = 0; i < size; ++i)
+    data[i] = i % 251;
+  unit_check(ufs_write(fd, data, size) == size, "a big append");
+  unit_check(ufs_pread(fd, back, size, 9) == size &&
+       memcmp(back, data, size) == 0, "keeps its data");
+  unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) == 9 + size,
+       "and the size");
+
+  unit_fail_if(ufs_resize(fd, 3 * 4096 + 100) != 0);
+  unit_fail_if(ufs_resize(fd, 6 * 4096 + 100) != 0);
+  unit_fail_if(ufs_write(fd, "end", 3) != 3);
+  unit_check(ufs_pread(fd, back, 4096 + 3, 5 * 4096 + 100) == 4096 + 3 &&
+       back[0] == 0 && back[4095] == 0 && memcmp(back + 4096, "end", 3) == 0,
+       "an append after a hole keeps the hole zeros");
+  unit_fail_if(ufs_close(fd) != 0);
+
+  fd = ufs_open("file", UFS_APPEND);
+  unit_check(ufs_write(fd, "more", 4) == 4 && ufs_read(fd, buf, 1) == 0,
+       "the flag alone allows reading and writing");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+
+  fd = ufs_open("file", UFS_CREATE | UFS_READ_WRITE | UFS_APPEND);
+  unit_check(fd != -1 && ufs_write(fd, "ab", 2) == 2 &&
+       ufs_pread(fd, buf, 2, 0) == 2, "create combines with the access flags");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  fd = ufs_open("file", UFS_CREATE | UFS_READ_ONLY);
+  unit_check(fd != -1 && ufs_write(fd, "ab", 2) == -1 &&
+       ufs_errno() == UFS_ERR_NO_PERMISSION, "and keeps their rights");
+  unit_fail_if(ufs_close(fd) != 0);
+  unit_fail_if(ufs_delete("file") != 0);
+  free(data);
+  free(back);
+
+  unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -324,9 +1174,24 @@ main(void)
   test_io();
   test_delete();
   test_stress_open();
+  test_many_files();
+  test_lowest_fd();
+  test_threads();
   test_max_file_size();
   test_rights();
   test_resize();
+  test_block_boundaries();
+  test_pread_pwrite();
+  test_vectored();
+  test_stats();
+  test_read_view();
+  test_block_size();
+  test_sparse();
+  test_seek();
+  test_persistence();
+  test_clone();
+  test_dirs();
+  test_append();
 
   unit_test_finish();
   return 0;
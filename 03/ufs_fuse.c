@@ -0,0 +1,1002 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
+
+#include "userfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * FUSE daemon exporting userfs through the low-level libfuse 3
+ * API, so that real tools can be pointed at it and compared
+ * with tmpfs. Requests are served by several threads, reads and
+ * writes go in chunks of up to 1 MiB and the kernel caches
+ * attributes, names and file pages, since nothing but the
+ * daemon changes the files.
+ *
+ * Usage: ufs_fuse.out [--image=path] [fuse options] mountpoint
+ * With --image the files are loaded from the image and saved
+ * back to it on unmount. For example:
+ *
+ *     ./ufs_fuse.out -f /mnt/ufs &
+ *     dd if=/dev/zero of=/mnt/ufs/file bs=1M count=512
+ *     fio --name=rand --directory=/mnt/ufs --rw=randrw \
+ *         --bs=4k --size=256m --numjobs=4 --fallocate=none
+ *     fusermount3 -u /mnt/ufs
+ */
+
+enum {
+  /** Biggest read and write request, the kernel limit. */
+  MAX_IO_SIZE = 1024 * 1024,
+  /** Capacity of the inode index at start. */
+  NODE_INDEX_MIN = 1024,
+  /** Smallest userfs block size, a read takes a view per block. */
+  MIN_BLOCK_SIZE = 4096,
+};
+
+/** How long the kernel may trust names and attributes, seconds. */
+static const double CACHE_TIMEOUT = 1.0;
+/** Inode number of a listed name never looked up, as in libfuse. */
+static const fuse_ino_t UNKNOWN_INO = 0xffffffff;
+
+/**
+ * Userfs names files by path and FUSE by inode number. A path
+ * gets a number when the kernel looks it up and keeps it until
+ * the kernel forgets all its lookups or the name is deleted. A
+ * deleted node leaves the index at once, so a file created
+ * under its name gets a new number and does not share the page
+ * cache of the old one, which stays reachable only through the
+ * handles still opened on it. Numbers of forgotten nodes are
+ * reused.
+ */
+struct node {
+  /** Path in userfs, "" for the root, NULL in a free slot. */
+  char *path;
+  /** Lookups the kernel has not forgotten yet. */
+  uint64_t nlookup;
+  /** Next free slot, for a free one. */
+  fuse_ino_t next_free;
+  bool is_dir;
+  /** The name is deleted, the path may be of another file now. */
+  bool unlinked;
+};
+
+/** Nodes by inode number. Slot 0 is unused, 1 is the root. */
+static struct node *nodes = NULL;
+static size_t node_count = 1;
+static size_t node_capacity = 0;
+/** First free slot of nodes below node_count, 0 if none. */
+static fuse_ino_t node_free = 0;
+/**
+ * Inode numbers by path, open addressing with linear probing.
+ * 0 marks a free slot. Capacity is a power of two.
+ */
+static fuse_ino_t *node_index = NULL;
+static size_t node_index_capacity = 0;
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Image given with --image, NULL when files are not saved. */
+struct options {
+  const char *image;
+};
+
+static struct options options = {NULL};
+
+static const struct fuse_opt option_spec[] = {
+  {"--image=%s", offsetof(struct options, image), 1},
+  FUSE_OPT_END
+};
+
+/** List of names of a directory taken at opendir. */
+struct dir_list {
+  char **names;
+  size_t count;
+};
+
+static uint64_t
+path_hash(const char *path)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *path != '\0'; ++path) {
+    hash ^= (unsigned char)*path;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static fuse_ino_t *
+node_slot(fuse_ino_t *index, size_t capacity, const char *path)
+{
+  size_t i = path_hash(path) & (capacity - 1);
+  while (index[i] != 0 && strcmp(nodes[index[i]].path, path) != 0)
+    i = (i + 1) & (capacity - 1);
+  return &index[i];
+}
+
+/**
+ * Find the inode number of a path, giving it a new one if it
+ * has none, and count a lookup of it.
+ * @param is_dir The path is of a directory.
+ * @retval 0 Not enough memory.
+ */
+static fuse_ino_t
+node_get(const char *path, bool is_dir)
+{
+  pthread_mutex_lock(&node_lock);
+  fuse_ino_t ino = 0;
+  if (2 * (node_count + 1) > node_index_capacity) {
+    size_t capacity = node_index_capacity == 0 ?
+                      NODE_INDEX_MIN : 2 * node_index_capacity;
+    fuse_ino_t *index = calloc(capacity, sizeof(*index));
+    if (index == NULL)
+      goto out;
+    for (size_t i = 0; i < node_index_capacity; ++i) {
+      if (node_index[i] != 0)
+        *node_slot(index, capacity, nodes[node_index[i]].path) = node_index[i];
+    }
+    free(node_index);
+    node_index = index;
+    node_index_capacity = capacity;
+  }
+  fuse_ino_t *slot = node_slot(node_index, node_index_capacity, path);
+  if (*slot != 0) {
+    ino = *slot;
+    ++nodes[ino].nlookup;
+    goto out;
+  }
+  if (node_free == 0 && node_count >= node_capacity) {
+    size_t capacity = node_capacity == 0 ? NODE_INDEX_MIN : 2 * node_capacity;
+    struct node *new_nodes = realloc(nodes, capacity * sizeof(*nodes));
+    if (new_nodes == NULL)
+      goto out;
+    nodes = new_nodes;
+    node_capacity = capacity;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL)
+    goto out;
+  if (node_free != 0) {
+    ino = node_free;
+    node_free = nodes[ino].next_free;
+  } else {
+    ino = node_count++;
+  }
+  nodes[ino].path = copy;
+  nodes[ino].nlookup = 1;
+  nodes[ino].is_dir = is_dir;
+  nodes[ino].unlinked = false;
+  *slot = ino;
+out:
+  pthread_mutex_unlock(&node_lock);
+  return ino;
+}
+
+/**
+ * Find the inode number of a path without giving it one.
+ * @retval 0 The path has no number.
+ */
+static fuse_ino_t
+node_find(const char *path)
+{
+  pthread_mutex_lock(&node_lock);
+  fuse_ino_t ino = node_index_capacity == 0 ? 0 :
+                   *node_slot(node_index, node_index_capacity, path);
+  pthread_mutex_unlock(&node_lock);
+  return ino;
+}
+
+/**
+ * Remove the index slot of a node. The following entries of its
+ * probe run are moved back, so the index needs no tombstones.
+ * node_lock must be locked.
+ */
+static void
+node_unhash(fuse_ino_t *slot)
+{
+  size_t mask = node_index_capacity - 1;
+  size_t hole = slot - node_index;
+  node_index[hole] = 0;
+  for (size_t i = (hole + 1) & mask; node_index[i] != 0; i = (i + 1) & mask) {
+    size_t home = path_hash(nodes[node_index[i]].path) & mask;
+    /* Entry i may move to the hole if its home is not in (hole, i]. */
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      node_index[hole] = node_index[i];
+      node_index[i] = 0;
+      hole = i;
+    }
+  }
+}
+
+/**
+ * Take a deleted path out of the index. Its node, if it has
+ * one, lives on until the kernel forgets it.
+ */
+static void
+node_unlink(const char *path)
+{
+  pthread_mutex_lock(&node_lock);
+  fuse_ino_t *slot = node_index_capacity == 0 ? NULL :
+                     node_slot(node_index, node_index_capacity, path);
+  if (slot != NULL && *slot != 0) {
+    nodes[*slot].unlinked = true;
+    node_unhash(slot);
+  }
+  pthread_mutex_unlock(&node_lock);
+}
+
+/**
+ * Take back @a nlookup lookups of a node and free it once none
+ * is left. The root stays.
+ */
+static void
+node_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+  pthread_mutex_lock(&node_lock);
+  if (ino <= FUSE_ROOT_ID || ino >= node_count || nodes[ino].path == NULL) {
+    pthread_mutex_unlock(&node_lock);
+    return;
+  }
+  /* Forgetting more than was counted frees the node too. */
+  if (nodes[ino].nlookup > nlookup) {
+    nodes[ino].nlookup -= nlookup;
+    pthread_mutex_unlock(&node_lock);
+    return;
+  }
+  if (!nodes[ino].unlinked)
+    node_unhash(node_slot(node_index, node_index_capacity, nodes[ino].path));
+  free(nodes[ino].path);
+  nodes[ino].path = NULL;
+  nodes[ino].next_free = node_free;
+  node_free = ino;
+  pthread_mutex_unlock(&node_lock);
+}
+
+/**
+ * Make the path of a name in the directory @a parent, or the
+ * path of @a parent itself when @a name is NULL. Must be freed.
+ * @retval NULL No such inode, its name is deleted or not enough
+ *     memory, errno is set.
+ */
+static char *
+node_path(fuse_ino_t parent, const char *name)
+{
+  pthread_mutex_lock(&node_lock);
+  char *path = NULL;
+  if (parent == 0 || parent >= node_count || nodes[parent].path == NULL ||
+      nodes[parent].unlinked) {
+    errno = ENOENT;
+  } else if (name == NULL) {
+    if ((path = strdup(nodes[parent].path)) == NULL)
+      errno = ENOMEM;
+  } else {
+    const char *dir = nodes[parent].path;
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    path = malloc(dir_len + name_len + 2);
+    if (path == NULL) {
+      errno = ENOMEM;
+    } else if (dir_len == 0) {
+      memcpy(path, name, name_len + 1);
+    } else {
+      memcpy(path, dir, dir_len);
+      path[dir_len] = '/';
+      memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+  }
+  pthread_mutex_unlock(&node_lock);
+  return path;
+}
+
+/**
+ * Tell whether a node is a regular file with its name deleted
+ * or not.
+ * @retval false No such node or it is a directory.
+ */
+static bool
+node_is_file(fuse_ino_t ino, bool *unlinked)
+{
+  pthread_mutex_lock(&node_lock);
+  bool is_file = ino != 0 && ino < node_count && nodes[ino].path != NULL &&
+                 !nodes[ino].is_dir;
+  *unlinked = is_file && nodes[ino].unlinked;
+  pthread_mutex_unlock(&node_lock);
+  return is_file;
+}
+
+/** Convert the last userfs error to an errno value. */
+static int
+ufs_to_errno(void)
+{
+  switch (ufs_errno()) {
+  case UFS_ERR_NO_ERR:
+    return 0;
+  case UFS_ERR_NO_FILE:
+    return ENOENT;
+  case UFS_ERR_NO_MEM:
+    return ENOSPC;
+  case UFS_ERR_NO_PERMISSION:
+    return EBADF;
+  case UFS_ERR_INVALID_ARG:
+    return EINVAL;
+  case UFS_ERR_EXISTS:
+    return EEXIST;
+  case UFS_ERR_IS_DIR:
+    return EISDIR;
+  case UFS_ERR_NOT_EMPTY:
+    return ENOTEMPTY;
+  case UFS_ERR_NOT_DIR:
+    return ENOTDIR;
+  case UFS_ERR_NOT_IMPLEMENTED:
+    return ENOSYS;
+  default:
+    return EIO;
+  }
+}
+
+/**
+ * Userfs keeps no owner, mode or times, so files belong to the
+ * daemon user.
+ */
+static void
+stat_init(struct stat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_blksize = MAX_IO_SIZE;
+}
+
+/**
+ * Fill attributes of a regular file from its descriptor. The
+ * size is taken with ufs_pseek(), which leaves the offset of a
+ * descriptor shared by other threads alone.
+ * @param nlink 0 for a file with its name deleted, 1 otherwise.
+ * @retval 0 Success.
+ * @retval >0 Errno value.
+ */
+static int
+fd_stat(int fd, nlink_t nlink, struct stat *st)
+{
+  stat_init(st);
+  off_t size = ufs_pseek(fd, 0, UFS_SEEK_END);
+  if (size == -1)
+    return ufs_to_errno();
+  st->st_mode = S_IFREG | 0644;
+  st->st_nlink = nlink;
+  st->st_size = size;
+  st->st_blocks = (size + 511) / 512;
+  return 0;
+}
+
+/**
+ * Fill attributes of the file or the directory a path names.
+ * @retval 0 Success.
+ * @retval >0 Errno value.
+ */
+static int
+path_stat(const char *path, struct stat *st)
+{
+  int fd = path[0] == '\0' ? -1 : ufs_open(path, UFS_READ_ONLY);
+  if (fd == -1 && (path[0] == '\0' || ufs_errno() == UFS_ERR_IS_DIR)) {
+    stat_init(st);
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    return 0;
+  }
+  if (fd == -1)
+    return ufs_to_errno();
+  int err = fd_stat(fd, 1, st);
+  ufs_close(fd);
+  return err;
+}
+
+/**
+ * Fill attributes of a node. A regular file opened by @a fi is
+ * described through the handle, since its name may be deleted
+ * and taken by another file already. The kernel passes the
+ * handle of a directory too, which is no userfs descriptor.
+ * @retval 0 Success.
+ * @retval >0 Errno value.
+ */
+static int
+node_stat(fuse_ino_t ino, struct fuse_file_info *fi, struct stat *st)
+{
+  bool unlinked;
+  int err;
+  if (fi != NULL && node_is_file(ino, &unlinked)) {
+    err = fd_stat((int)fi->fh, unlinked ? 0 : 1, st);
+  } else {
+    char *path = node_path(ino, NULL);
+    if (path == NULL)
+      return errno;
+    err = path_stat(path, st);
+    free(path);
+  }
+  st->st_ino = ino;
+  return err;
+}
+
+/**
+ * Reply to a request creating a name with its inode number and
+ * attributes.
+ * @param fd Descriptor opened on the new file, with @a fi.
+ */
+static void
+reply_entry(fuse_req_t req, const char *path, int fd, struct fuse_file_info *fi)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  int err = fi != NULL ? fd_stat(fd, 1, &e.attr) : path_stat(path, &e.attr);
+  if (err == 0 && (e.ino = node_get(path, S_ISDIR(e.attr.st_mode))) == 0)
+    err = ENOMEM;
+  if (err != 0) {
+    if (fi != NULL)
+      ufs_close(fd);
+    fuse_reply_err(req, err);
+    return;
+  }
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = CACHE_TIMEOUT;
+  e.entry_timeout = CACHE_TIMEOUT;
+  /* A lookup the kernel did not get must not be counted. */
+  if (fi == NULL) {
+    if (fuse_reply_entry(req, &e) != 0)
+      node_forget(e.ino, 1);
+  } else if (fuse_reply_create(req, &e, fi) != 0) {
+    node_forget(e.ino, 1);
+    ufs_close(fd);
+  }
+}
+
+static void
+op_init(void *userdata, struct fuse_conn_info *conn)
+{
+  (void)userdata;
+  conn->max_write = MAX_IO_SIZE;
+  conn->max_readahead = MAX_IO_SIZE;
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_ASYNC_DIO)
+    conn->want |= FUSE_CAP_ASYNC_DIO;
+  if (conn->capable & FUSE_CAP_PARALLEL_DIROPS)
+    conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+}
+
+static void
+op_destroy(void *userdata)
+{
+  (void)userdata;
+  if (options.image != NULL && ufs_sync() != 0)
+    fprintf(stderr, "ufs_fuse: can't save %s\n", options.image);
+}
+
+static void
+op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  char *path = node_path(parent, name);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  reply_entry(req, path, -1, NULL);
+  free(path);
+}
+
+static void
+op_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  node_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void
+op_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  for (size_t i = 0; i < count; ++i)
+    node_forget(forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void
+op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat st;
+  int err = node_stat(ino, fi, &st);
+  if (err != 0)
+    fuse_reply_err(req, err);
+  else
+    fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+/**
+ * Only the size can be changed, through ufs_resize(). Mode,
+ * owner and times are not stored and their changes are
+ * silently accepted, so that cp -p and touch work.
+ */
+static void
+op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+           struct fuse_file_info *fi)
+{
+  int err = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    bool unlinked;
+    bool own = fi == NULL || !node_is_file(ino, &unlinked);
+    int fd = own ? -1 : (int)fi->fh;
+    if (own) {
+      char *path = node_path(ino, NULL);
+      if (path == NULL)
+        err = errno;
+      else if ((fd = ufs_open(path, UFS_WRITE_ONLY)) == -1)
+        err = ufs_to_errno();
+      free(path);
+    }
+    if (fd != -1 && ufs_resize(fd, attr->st_size) != 0)
+      err = ufs_to_errno();
+    if (fd != -1 && own)
+      ufs_close(fd);
+  }
+  struct stat st;
+  if (err == 0)
+    err = node_stat(ino, fi, &st);
+  if (err != 0)
+    fuse_reply_err(req, err);
+  else
+    fuse_reply_attr(req, &st, CACHE_TIMEOUT);
+}
+
+static void
+op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  (void)mode;
+  char *path = node_path(parent, name);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  if (ufs_mkdir(path) != 0)
+    fuse_reply_err(req, ufs_to_errno());
+  else
+    reply_entry(req, path, -1, NULL);
+  free(path);
+}
+
+/**
+ * Both unlink and rmdir, ufs_delete() removes either. The node
+ * of the name leaves the index before the reply, so a create
+ * that follows it gets a new number.
+ */
+static void
+op_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  char *path = node_path(parent, name);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  int err = ufs_delete(path) != 0 ? ufs_to_errno() : 0;
+  if (err == 0)
+    node_unlink(path);
+  fuse_reply_err(req, err);
+  free(path);
+}
+
+/** Convert open(2) flags to userfs ones. */
+static int
+open_flags(int flags)
+{
+  switch (flags & O_ACCMODE) {
+  case O_RDONLY:
+    return UFS_READ_ONLY;
+  case O_WRONLY:
+    return UFS_WRITE_ONLY;
+  default:
+    return UFS_READ_WRITE;
+  }
+}
+
+/**
+ * Open a file for FUSE: the userfs descriptor becomes the file
+ * handle. Pages stay cached between opens, nobody but the
+ * kernel itself changes the files.
+ * @param create Create a missing file.
+ * @retval -1 Error occurred, errno is set.
+ */
+static int
+open_file(const char *path, struct fuse_file_info *fi, bool create)
+{
+  int fd = ufs_open(path, (create ? UFS_CREATE : 0) | open_flags(fi->flags));
+  if (fd == -1) {
+    errno = ufs_to_errno();
+    return -1;
+  }
+  if ((fi->flags & O_TRUNC) && ufs_resize(fd, 0) != 0) {
+    errno = ufs_to_errno();
+    ufs_close(fd);
+    return -1;
+  }
+  fi->fh = fd;
+  fi->keep_cache = 1;
+  return fd;
+}
+
+static void
+op_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+          struct fuse_file_info *fi)
+{
+  (void)mode;
+  char *path = node_path(parent, name);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  int fd = -1;
+  if (fi->flags & O_EXCL) {
+    fd = ufs_open(path, UFS_READ_ONLY);
+    if (fd != -1 || ufs_errno() == UFS_ERR_IS_DIR) {
+      if (fd != -1)
+        ufs_close(fd);
+      fuse_reply_err(req, EEXIST);
+      free(path);
+      return;
+    }
+  }
+  fd = open_file(path, fi, true);
+  if (fd == -1)
+    fuse_reply_err(req, errno);
+  else
+    reply_entry(req, path, fd, fi);
+  free(path);
+}
+
+static void
+op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char *path = node_path(ino, NULL);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  if (open_file(path, fi, false) == -1)
+    fuse_reply_err(req, errno);
+  else if (fuse_reply_open(req, fi) != 0)
+    ufs_close(fi->fh);
+  free(path);
+}
+
+static void
+op_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  (void)ino;
+  ufs_close(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+/**
+ * Reads reply with views of the file blocks, so the data goes
+ * from the blocks into the reply in one copy, or is spliced
+ * into the device when the kernel allows it. The views keep the
+ * blocks alive until the reply is sent. Views, like writes, are
+ * positional and take no descriptor offset, so one handle
+ * serves several threads.
+ */
+static void
+op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+  (void)ino;
+  size_t max_views = size / MIN_BLOCK_SIZE + 2;
+  struct ufs_view *views = malloc(max_views * sizeof(*views));
+  struct fuse_bufvec *data = calloc(1, sizeof(*data) +
+                                    max_views * sizeof(data->buf[0]));
+  if (views == NULL || data == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    free(data);
+    free(views);
+    return;
+  }
+  size_t done = 0;
+  int err = 0;
+  while (done < size) {
+    struct ufs_view *view = &views[data->count];
+    ssize_t n = ufs_pread_view(fi->fh, view, off + done);
+    if (n <= 0) {
+      err = n == -1 ? ufs_to_errno() : 0;
+      break;
+    }
+    struct fuse_buf *buf = &data->buf[data->count++];
+    buf->size = (size_t)n < size - done ? (size_t)n : size - done;
+    buf->mem = (void *)view->data;
+    done += buf->size;
+  }
+  if (err != 0)
+    fuse_reply_err(req, err);
+  else if (data->count == 0)
+    fuse_reply_buf(req, NULL, 0);
+  else
+    fuse_reply_data(req, data, 0);
+  for (size_t i = 0; i < data->count; ++i)
+    ufs_release_view(&views[i]);
+  free(data);
+  free(views);
+}
+
+/**
+ * Data the kernel spliced into a pipe is copied into memory
+ * once. Data already in memory is written from where it is.
+ */
+static void
+op_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t off,
+             struct fuse_file_info *fi)
+{
+  (void)ino;
+  size_t size = fuse_buf_size(in);
+  char *copy = NULL;
+  const char *data;
+  if (in->count == 1 && !(in->buf[0].flags & FUSE_BUF_IS_FD)) {
+    data = in->buf[0].mem;
+  } else {
+    copy = malloc(size);
+    if (copy == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+    out.buf[0].mem = copy;
+    ssize_t copied = fuse_buf_copy(&out, in, 0);
+    if (copied < 0) {
+      fuse_reply_err(req, -copied);
+      free(copy);
+      return;
+    }
+    size = copied;
+    data = copy;
+  }
+  ssize_t n = ufs_pwrite(fi->fh, data, size, off);
+  if (n == -1)
+    fuse_reply_err(req, ufs_to_errno());
+  else
+    fuse_reply_write(req, n);
+  free(copy);
+}
+
+static void
+op_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  (void)ino;
+  (void)fi;
+  fuse_reply_err(req, 0);
+}
+
+/** Saves the image if there is one, everything else is in memory. */
+static void
+op_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+         struct fuse_file_info *fi)
+{
+  (void)ino;
+  (void)datasync;
+  (void)fi;
+  if (options.image != NULL && ufs_sync() != 0)
+    fuse_reply_err(req, ufs_to_errno());
+  else
+    fuse_reply_err(req, 0);
+}
+
+static void
+op_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+         struct fuse_file_info *fi)
+{
+  (void)ino;
+  int ufs_whence;
+  if (whence == SEEK_DATA) {
+    ufs_whence = UFS_SEEK_DATA;
+  } else if (whence == SEEK_HOLE) {
+    ufs_whence = UFS_SEEK_HOLE;
+  } else {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  off_t pos = ufs_pseek(fi->fh, off, ufs_whence);
+  if (pos == -1)
+    fuse_reply_err(req, ufs_errno() == UFS_ERR_INVALID_ARG ? ENXIO : ufs_to_errno());
+  else
+    fuse_reply_lseek(req, pos);
+}
+
+static void
+dir_list_free(struct dir_list *list)
+{
+  for (size_t i = 0; i < list->count; ++i)
+    free(list->names[i]);
+  free(list->names);
+  free(list);
+}
+
+/**
+ * The names are copied at opendir, so that readdir can go on
+ * from any offset the kernel asks for.
+ */
+static void
+op_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char *path = node_path(ino, NULL);
+  if (path == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  struct ufs_dir *dir = ufs_opendir(path);
+  free(path);
+  if (dir == NULL) {
+    fuse_reply_err(req, ufs_to_errno());
+    return;
+  }
+  struct dir_list *list = calloc(1, sizeof(*list));
+  size_t capacity = 0;
+  const char *name;
+  while (list != NULL && (name = ufs_readdir(dir)) != NULL) {
+    if (list->count == capacity) {
+      capacity = capacity == 0 ? 16 : 2 * capacity;
+      char **names = realloc(list->names, capacity * sizeof(*names));
+      if (names == NULL)
+        goto error;
+      list->names = names;
+    }
+    if ((list->names[list->count] = strdup(name)) == NULL)
+      goto error;
+    ++list->count;
+  }
+  ufs_closedir(dir);
+  if (list == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  fi->fh = (uintptr_t)list;
+  fi->cache_readdir = 1;
+  fi->keep_cache = 1;
+  if (fuse_reply_open(req, fi) != 0)
+    dir_list_free(list);
+  return;
+error:
+  ufs_closedir(dir);
+  dir_list_free(list);
+  fuse_reply_err(req, ENOMEM);
+}
+
+/**
+ * Offset 0 and 1 are "." and "..", offset i + 2 is the i-th
+ * name of the list. Readdir is no lookup, so names get no
+ * inode numbers here: a name the kernel knows has its number,
+ * the others UNKNOWN_INO, since some tools skip entries with 0.
+ */
+static void
+op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+           struct fuse_file_info *fi)
+{
+  struct dir_list *list = (struct dir_list *)(uintptr_t)fi->fh;
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  size_t used = 0;
+  for (size_t i = off; i < list->count + 2; ++i) {
+    const char *name = i == 0 ? "." : i == 1 ? ".." : list->names[i - 2];
+    st.st_mode = i < 2 ? S_IFDIR : 0;
+    st.st_ino = ino;
+    if (i >= 2) {
+      char *path = node_path(ino, name);
+      st.st_ino = path != NULL ? node_find(path) : 0;
+      st.st_ino = st.st_ino != 0 ? st.st_ino : UNKNOWN_INO;
+      free(path);
+    }
+    size_t entry_size = fuse_add_direntry(req, buf + used, size - used, name,
+                                          &st, i + 1);
+    if (entry_size > size - used)
+      break;
+    used += entry_size;
+  }
+  fuse_reply_buf(req, buf, used);
+  free(buf);
+}
+
+static void
+op_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  (void)ino;
+  dir_list_free((struct dir_list *)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops ops = {
+  .init = op_init,
+  .destroy = op_destroy,
+  .lookup = op_lookup,
+  .forget = op_forget,
+  .forget_multi = op_forget_multi,
+  .getattr = op_getattr,
+  .setattr = op_setattr,
+  .mkdir = op_mkdir,
+  .unlink = op_unlink,
+  .rmdir = op_unlink,
+  .create = op_create,
+  .open = op_open,
+  .release = op_release,
+  .read = op_read,
+  .write_buf = op_write_buf,
+  .flush = op_flush,
+  .fsync = op_fsync,
+  .lseek = op_lseek,
+  .opendir = op_opendir,
+  .readdir = op_readdir,
+  .releasedir = op_releasedir,
+};
+
+int
+main(int argc, char *argv[])
+{
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  int ret = 1;
+  if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0 ||
+      fuse_parse_cmdline(&args, &opts) != 0)
+    return 1;
+  if (opts.show_help) {
+    printf("usage: %s [--image=path] [options] mountpoint\n", argv[0]);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    ret = 0;
+    goto out_args;
+  }
+  if (opts.show_version) {
+    fuse_lowlevel_version();
+    ret = 0;
+    goto out_args;
+  }
+  if (opts.mountpoint == NULL) {
+    fprintf(stderr, "usage: %s [--image=path] [options] mountpoint\n", argv[0]);
+    goto out_args;
+  }
+  if (options.image != NULL && ufs_mount(options.image) != 0) {
+    fprintf(stderr, "ufs_fuse: can't mount %s\n", options.image);
+    goto out_args;
+  }
+  if (node_get("", true) != FUSE_ROOT_ID)
+    goto out_args;
+  struct fuse_session *se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+  if (se == NULL)
+    goto out_args;
+  if (fuse_set_signal_handlers(se) != 0)
+    goto out_session;
+  if (fuse_session_mount(se, opts.mountpoint) != 0)
+    goto out_signals;
+  fuse_daemonize(opts.foreground);
+  if (opts.singlethread) {
+    ret = fuse_session_loop(se);
+  } else {
+    struct fuse_loop_config config;
+    config.clone_fd = opts.clone_fd;
+    config.max_idle_threads = opts.max_idle_threads;
+    ret = fuse_session_loop_mt(se, &config);
+  }
+  fuse_session_unmount(se);
+out_signals:
+  fuse_remove_signal_handlers(se);
+out_session:
+  fuse_session_destroy(se);
+out_args:
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return ret != 0;
+}
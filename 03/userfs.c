@@ -1,80 +1,399 @@
 #include "userfs.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 enum {
-  BLOCK_SIZE = 512,
+  /** Block sizes a file can have are 1 << shift for these shifts. */
+  BLOCK_SHIFT_MIN = 12,
+  BLOCK_SHIFT_MAX = 21,
+  BLOCK_SHIFT_DEFAULT = 16,
+  /** Default limit of the file size. */
   MAX_FILE_SIZE = 1024 * 1024 * 1024,
+  FD_CHUNK_SIZE = 1024,
+  FD_MAX_CHUNKS = 1024,
+  /** How much a pool maps at once, at least one object. */
+  SLAB_BYTES = 1024 * 1024,
+  FILE_SLAB_SIZE = 256,
+  /** How many blocks an append takes from the pool at once. */
+  APPEND_BATCH = 64,
+  /* Open flags which allow reading and writing. */
+  READ_RIGHTS = UFS_READ_ONLY | UFS_READ_WRITE,
+  WRITE_RIGHTS = UFS_WRITE_ONLY | UFS_READ_WRITE,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * Locking. The name index and the directory tree are guarded
+ * by index_lock: lookups take it shared, creation and deletion
+ * exclusive. Every file has its own rwlock guarding its
+ * blocks, size and descriptor list: reads take it shared,
+ * writes and resizes exclusive, so readers of different files
+ * never touch a common lock. Descriptors are looked up without
+ * locks. fd_lock serializes only taking and freeing descriptor
+ * numbers. Each memory pool has its own mutex, taken last.
+ * Locks are taken in the order index_lock, file lock, fd_lock,
+ * pool lock.
+ *
+ * A descriptor must not be used by several threads at once,
+ * the same as its offset would not make sense then.
+ */
+
+/** Error code of the last failed call of the thread. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/** Limit of the file size, see ufs_set_max_file_size(). */
+static size_t max_file_size = MAX_FILE_SIZE;
+
+/** What holes of files read as. Never written. */
+static char zero_block[1 << BLOCK_SHIFT_MAX];
 
 struct block {
-  /** Block memory. */
-  char *memory;
-  /** How many bytes are occupied. */
-  int occupied;
-  /** Next block in the file. */
-  struct block *next;
-  /** Previous block in the file. */
-  struct block *prev;
+  /** Links the free list of the pool while the block is free. */
+  struct block *next_free;
+  /**
+   * References to the block: one per file holding it, as
+   * clones share blocks, and one per read view on it. Changed
+   * atomically, as views are taken under a shared file lock and
+   * released without any. A block with more than one reference
+   * is copied before a write, so neither a view nor another
+   * file sees its data change.
+   */
+  int refs;
+  /** Log2 of the block size, selects the pool of the block. */
+  unsigned char shift;
+  /**
+   * Set for a block living in the mapped image of the file
+   * system rather than in a pool. Such a block is not freed.
+   */
+  bool image;
+  /** Block memory, right after the header. */
+  char memory[] __attribute__((aligned(64)));
+};
+
+/**
+ * Pool of objects of one size. Objects are carved from slabs
+ * mapped with mmap, many at once, and go to a free list when
+ * freed, so churn of files and blocks does not reach malloc.
+ * Slabs are never unmapped. The first word of a free object
+ * links the free list.
+ */
+struct pool {
+  pthread_mutex_t lock;
+  size_t object_size;
+  size_t slab_size;
+  void *free_list;
+  /** Bytes mapped for slabs. */
+  size_t mapped;
+  size_t used;
+  size_t free;
+};
+
+#define BLOCK_POOL(shift) {                                          \
+  PTHREAD_MUTEX_INITIALIZER, sizeof(struct block) + (1 << (shift)),  \
+  (1 << (shift)) < SLAB_BYTES ? SLAB_BYTES >> (shift) : 1,           \
+  NULL, 0, 0, 0,                                                     \
+}
+
+/** Pools of blocks, one per block size. */
+static struct pool block_pools[BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN + 1] = {
+  BLOCK_POOL(12), BLOCK_POOL(13), BLOCK_POOL(14), BLOCK_POOL(15),
+  BLOCK_POOL(16), BLOCK_POOL(17), BLOCK_POOL(18), BLOCK_POOL(19),
+  BLOCK_POOL(20), BLOCK_POOL(21),
 };
 
+/** Maps a new slab and puts its objects on the free list. */
+static int
+pool_grow(struct pool *pool)
+{
+  size_t bytes = pool->object_size * pool->slab_size;
+  char *slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slab == MAP_FAILED) {
+    return -1;
+  }
+  for (size_t i = pool->slab_size; i > 0; --i) {
+    void **object = (void **) (slab + (i - 1) * pool->object_size);
+    *object = pool->free_list;
+    pool->free_list = object;
+  }
+  pool->mapped += bytes;
+  pool->free += pool->slab_size;
+  return 0;
+}
+
+/** Takes an object from the pool, NULL if out of memory. */
+static void *
+pool_alloc(struct pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (pool->free_list == NULL && pool_grow(pool) == -1) {
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+  void **object = pool->free_list;
+  pool->free_list = *object;
+  --pool->free;
+  ++pool->used;
+  pthread_mutex_unlock(&pool->lock);
+  return object;
+}
+
+/**
+ * Takes up to @a count objects from the pool under one lock.
+ * @retval Number of objects taken, less than @a count if out
+ *     of memory.
+ */
+static size_t
+pool_alloc_batch(struct pool *pool, void **objects, size_t count)
+{
+  pthread_mutex_lock(&pool->lock);
+  size_t taken = 0;
+  while (taken < count) {
+    if (pool->free_list == NULL && pool_grow(pool) == -1) {
+      break;
+    }
+    void **object = pool->free_list;
+    pool->free_list = *object;
+    objects[taken++] = object;
+  }
+  pool->free -= taken;
+  pool->used += taken;
+  pthread_mutex_unlock(&pool->lock);
+  return taken;
+}
+
+static void
+pool_free(struct pool *pool, void *object)
+{
+  pthread_mutex_lock(&pool->lock);
+  *(void **) object = pool->free_list;
+  pool->free_list = object;
+  ++pool->free;
+  --pool->used;
+  pthread_mutex_unlock(&pool->lock);
+}
+
 struct file {
-  /** Double-linked list of file blocks. */
-  struct block *block_list;
   /**
-   * Last block in the list above for fast access to the end
-   * of file.
+   * Table of file blocks. Block i holds bytes
+   * [i << block_shift, (i + 1) << block_shift) of the file, so
+   * any offset is reached in O(1). The table spans the file
+   * size. A NULL entry is a hole: it reads as zeros and gets a
+   * block on the first write. Bytes of a block past the file
+   * size are undefined.
+   */
+  struct block **blocks;
+  size_t block_count;
+  size_t block_capacity;
+  /** Log2 of the block size of the file. */
+  unsigned char block_shift;
+  /** Guards the blocks, the size and the descriptor list. */
+  pthread_rwlock_t lock;
+  /**
+   * How many file descriptors are opened on the file. Changed
+   * under the file lock and shared index_lock, so it is stable
+   * under exclusive index_lock.
    */
-  struct block *last_block;
-  /** How many file descriptors are opened on the file. */
   int refs;
-  /** File name. */
+  /** Double-linked list of the descriptors opened on the file. */
+  struct filedesc *descriptors;
+  /** Full path of the file, components split by '/'. */
   const char *name;
-  /** Files are stored in a double-linked list. */
-  struct file *next;
-  struct file *prev;
+  /** Hash of the name, kept for the name index. */
+  uint64_t hash;
+  /** Set for a directory, which has files instead of data. */
+  bool is_dir;
+  /**
+   * Directory the file is in, files of a directory and the
+   * double-linked list of files in the same directory. Guarded
+   * by index_lock.
+   */
+  struct file *parent;
+  struct file *children;
+  struct file *next_sibling;
+  struct file *prev_sibling;
+  /**
+   * Set when the file is deleted while descriptors are still
+   * opened on it. Such a file is not in the name index and is
+   * freed by the last ufs_close().
+   */
+  bool unlinked;
 
-  int size;
+  size_t size;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+static struct pool file_pool = {
+  PTHREAD_MUTEX_INITIALIZER, sizeof(struct file), FILE_SLAB_SIZE, NULL, 0, 0, 0,
+};
 
-struct file* find_file(const char* name) {
-  struct file* head = file_list;
-  while (head != NULL) {
-    if (strcmp(head->name, name)==0) {
-      return head;
+/**
+ * Name index of all files and directories by full path: an
+ * open addressing hash table with linear probing. The capacity
+ * is a power of two and the table is kept at most half full,
+ * so a lookup probes few slots. It works as a cache of whole
+ * paths: a file is found by one probe however deep it is, and
+ * directories are not walked component by component.
+ */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct file **file_index = NULL;
+static size_t file_index_capacity = 0;
+static size_t file_count = 0;
+
+uint64_t
+hash_name(const char *name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *name != '\0'; ++name) {
+    hash ^= (unsigned char)*name;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Returns the index slot of the file named @a name, or the
+ * empty slot where it would be placed.
+ */
+size_t
+index_slot(const char *name, uint64_t hash) {
+  size_t mask = file_index_capacity - 1;
+  size_t i = hash & mask;
+  while (file_index[i] != NULL) {
+    if (file_index[i]->hash == hash && strcmp(file_index[i]->name, name) == 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+int
+index_grow() {
+  size_t old_cap = file_index_capacity;
+  struct file **old = file_index;
+  size_t new_cap = old_cap == 0 ? 64 : old_cap * 2;
+  struct file **new_index = calloc(new_cap, sizeof(struct file*));
+  if (new_index == NULL) {
+    return -1;
+  }
+  file_index = new_index;
+  file_index_capacity = new_cap;
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old[i] != NULL) {
+      file_index[index_slot(old[i]->name, old[i]->hash)] = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+/**
+ * Empties the slot and moves the following entries of its probe
+ * run back, so the table needs no tombstones.
+ */
+void
+index_remove(size_t slot) {
+  size_t mask = file_index_capacity - 1;
+  file_index[slot] = NULL;
+  --file_count;
+  for (size_t i = (slot + 1) & mask; file_index[i] != NULL; i = (i + 1) & mask) {
+    size_t home = file_index[i]->hash & mask;
+    /* Entry i may move to slot if its home is not in (slot, i]. */
+    if (((i - home) & mask) >= ((i - slot) & mask)) {
+      file_index[slot] = file_index[i];
+      file_index[i] = NULL;
+      slot = i;
     }
-    head = head->next;
   }
-  return head;
+}
+
+struct file* find_file(const char* name) {
+  if (file_count == 0) {
+    return NULL;
+  }
+  return file_index[index_slot(name, hash_name(name))];
+}
+
+/** Root directory. It is not in the name index. */
+static struct file root_dir = {.is_dir = true, .name = ""};
+
+/**
+ * Returns @a path without its leading slashes. Every path is
+ * from the root, so "/a/b" and "a/b" name the same file and
+ * "/" is the root itself.
+ */
+static const char*
+skip_root(const char* path) {
+  while (*path == '/') {
+    ++path;
+  }
+  return path;
+}
+
+/**
+ * Finds the directory a new file named @a path goes to, the
+ * root for a name without slashes. index_lock must be locked.
+ * @retval NULL No such directory, or the path ends with '/'.
+ */
+struct file*
+find_parent(const char* path) {
+  const char* slash = strrchr(path, '/');
+  if (slash == NULL) {
+    return path[0] == '\0' ? NULL : &root_dir;
+  }
+  if (slash[1] == '\0') {
+    return NULL;
+  }
+  char* dir = strndup(path, slash - path);
+  if (dir == NULL) {
+    return NULL;
+  }
+  struct file* parent = find_file(dir);
+  free(dir);
+  return parent != NULL && parent->is_dir ? parent : NULL;
 }
 
 struct filedesc {
+  /** File of an opened descriptor, NULL in a free slot. */
   struct file *file;
 
   int id;
-  int offset;
+  /**
+   * Position of the descriptor in the file. Block
+   * offset >> block_shift is the current one, so the cursor
+   * is resolved in O(1) and never points into freed blocks.
+   */
+  size_t offset;
   int flag;
+  /** Neighbours in the descriptor list of the file. */
+  struct filedesc *next;
+  struct filedesc *prev;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * Table of file descriptors. Descriptor fd is slot
+ * fd % FD_CHUNK_SIZE of chunk fd / FD_CHUNK_SIZE. Slots are
+ * stored in place and chunks never move, so pointers to them
+ * stay valid while the table grows. A bit of fd_used is set
+ * for every opened descriptor, and fd_hint is the lowest
+ * descriptor that may be free, so ufs_open() takes the lowest
+ * free descriptor scanning 64 slots per step. The chunk array
+ * has a fixed size, so it can be read without locks.
  */
-static struct filedesc **file_descriptors = NULL;
-static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct filedesc *fd_chunks[FD_MAX_CHUNKS];
+static int fd_chunk_count = 0;
+static uint64_t *fd_used = NULL;
+static int fd_hint = 0;
 
 enum ufs_error_code
 ufs_errno()
@@ -82,51 +401,109 @@ ufs_errno()
   return ufs_error_code;
 }
 
-struct filedesc* create_filedesc(struct file* file) {
-  struct filedesc* fd = malloc(sizeof(struct filedesc));
-  if (fd == NULL) {
-    perror("malloc");
-    exit(EXIT_FAILURE);
+int
+fd_table_grow() {
+  if (fd_chunk_count == FD_MAX_CHUNKS) {
+    return -1;
   }
-  fd->file = file;
-  fd->offset = 0;
+  size_t words = FD_CHUNK_SIZE / 64;
+  uint64_t *new_used =
+    realloc(fd_used, (fd_chunk_count + 1) * words * sizeof(uint64_t));
+  if (new_used == NULL) {
+    return -1;
+  }
+  fd_used = new_used;
+  struct filedesc *chunk = calloc(FD_CHUNK_SIZE, sizeof(struct filedesc));
+  if (chunk == NULL) {
+    return -1;
+  }
+  memset(fd_used + fd_chunk_count * words, 0, words * sizeof(uint64_t));
+  fd_chunks[fd_chunk_count] = chunk;
+  __atomic_store_n(&fd_chunk_count, fd_chunk_count + 1, __ATOMIC_RELEASE);
+  return 0;
+}
 
-  int id = 0;
-  for (int i = 0; i < file_descriptor_count; ++i) {
-    if (file_descriptors[i] != NULL) {
-      ++id;
-      continue;
-    } 
-    break;
+/**
+ * Takes the lowest free descriptor number.
+ * @retval -1 The table can not grow.
+ */
+int
+take_fd() {
+  pthread_mutex_lock(&fd_lock);
+  int words = fd_chunk_count * (FD_CHUNK_SIZE / 64);
+  int word = fd_hint / 64;
+  while (word < words && fd_used[word] == UINT64_MAX) {
+    ++word;
+  }
+  if (word == words && fd_table_grow() == -1) {
+    pthread_mutex_unlock(&fd_lock);
+    return -1;
+  }
+  int id = word * 64 + __builtin_ctzll(~fd_used[word]);
+  fd_used[word] |= 1ULL << (id % 64);
+  fd_hint = id + 1;
+  pthread_mutex_unlock(&fd_lock);
+  return id;
+}
+
+void
+put_fd(int id) {
+  pthread_mutex_lock(&fd_lock);
+  fd_used[id / 64] &= ~(1ULL << (id % 64));
+  if (id < fd_hint) {
+    fd_hint = id;
+  }
+  pthread_mutex_unlock(&fd_lock);
+}
+
+/**
+ * Opens a descriptor on the file. The descriptor becomes
+ * visible to lookups only when it is filled in.
+ */
+struct filedesc* create_filedesc(struct file* file, int flags) {
+  int id = take_fd();
+  if (id == -1) {
+    return NULL;
   }
+  struct filedesc* fd = &fd_chunks[id / FD_CHUNK_SIZE][id % FD_CHUNK_SIZE];
   fd->id = id;
-  if (file_descriptor_count == id) {
-    if (file_descriptor_count + 1 > file_descriptor_capacity) { 
-      int new_cap = (file_descriptor_capacity + 1) * 2;
-      int new_size = new_cap * sizeof(struct filedesc*);
-      struct filedesc** new_filedesc = realloc(file_descriptors, new_size);
-      if (new_filedesc == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-      }
-      file_descriptors = new_filedesc;
-      file_descriptor_capacity = new_cap;
-    }
-    ++file_descriptor_count;
+  fd->offset = 0;
+  int mode = flags & ~(UFS_CREATE | UFS_APPEND);
+  fd->flag = (mode == 0 ? UFS_READ_WRITE : mode) | (flags & UFS_APPEND);
+  fd->prev = NULL;
+  pthread_rwlock_wrlock(&file->lock);
+  fd->next = file->descriptors;
+  if (file->descriptors != NULL) {
+    file->descriptors->prev = fd;
   }
-  file_descriptors[id] = fd;
+  file->descriptors = fd;
+  ++file->refs;
+  pthread_rwlock_unlock(&file->lock);
+  __atomic_store_n(&fd->file, file, __ATOMIC_RELEASE);
   return fd;
 }
 
-struct file* create_file(const char* filename) {
-  struct file* file = malloc(sizeof(struct file));
+/**
+ * Creates a file named @a filename in directory @a parent.
+ * index_lock must be locked exclusively.
+ */
+struct file* create_file(const char* filename, struct file* parent) {
+  struct file* file = pool_alloc(&file_pool);
   if (file == NULL) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  if ((file_count + 1) * 2 > file_index_capacity && index_grow() == -1) {
     perror("malloc");
     exit(EXIT_FAILURE);
   }
-  file->block_list = NULL;
-  file->last_block = NULL;
+  file->blocks = NULL;
+  file->block_count = 0;
+  file->block_capacity = 0;
+  file->block_shift = BLOCK_SHIFT_DEFAULT;
+  pthread_rwlock_init(&file->lock, NULL);
   file->refs = 0;
+  file->descriptors = NULL;
 
   char* name = malloc(strlen(filename) + 1);
   if (name == NULL) {
@@ -135,315 +512,1368 @@ struct file* create_file(const char* filename) {
   }
   memcpy(name, filename, strlen(filename) + 1);
   file->name = name;
-
-  file->prev = NULL;
-  if (file_list == NULL) {
-    file->next = NULL;
-  } else {
-    file->next = file_list;
-    file_list->prev = file;
-  }
+  file->hash = hash_name(name);
+  file->unlinked = false;
   file->size = 0;
-  file_list = file;
+  file->is_dir = false;
+  file->parent = parent;
+  file->children = NULL;
+  file->prev_sibling = NULL;
+  file->next_sibling = parent->children;
+  if (parent->children != NULL) {
+    parent->children->prev_sibling = file;
+  }
+  parent->children = file;
+  file_index[index_slot(name, file->hash)] = file;
+  ++file_count;
   return file;
 }
 
 int
 ufs_open(const char *filename, int flags)
 {
+  filename = skip_root(filename);
+  pthread_rwlock_rdlock(&index_lock);
   struct file* file = find_file(filename);
-  if (file == NULL) {
-    if (flags == UFS_CREATE) {
-      file = create_file(filename);
-      if (file == NULL) {
-        return -1;
-      }
-    } else {
-      ufs_error_code = UFS_ERR_NO_FILE;
-      return -1;
+  if (file == NULL && (flags & UFS_CREATE)) {
+    pthread_rwlock_unlock(&index_lock);
+    pthread_rwlock_wrlock(&index_lock);
+    file = find_file(filename);
+    struct file* parent = NULL;
+    if (file == NULL && (parent = find_parent(filename)) != NULL) {
+      file = create_file(filename, parent);
     }
   }
-  struct filedesc* fd = create_filedesc(file);
+  if (file == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  if (file->is_dir) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_IS_DIR;
+    return -1;
+  }
+  struct filedesc* fd = create_filedesc(file, flags);
+  pthread_rwlock_unlock(&index_lock);
   if (fd == NULL) {
+    ufs_error_code = UFS_ERR_NO_MEM;
     return -1;
   }
-  fd->flag = flags == 0 ? UFS_READ_WRITE : flags;
-  ++file->refs;
   return fd->id;
 }
 
 struct filedesc* find_filedesc(int fd) {
-  for (int i = 0; i < file_descriptor_count; ++i) {
-    if (file_descriptors[i] != NULL &&
-        file_descriptors[i]->id == fd) {
-      return file_descriptors[i]; 
-    }
+  if (fd < 0 || fd >= __atomic_load_n(&fd_chunk_count, __ATOMIC_ACQUIRE) * FD_CHUNK_SIZE) {
+    return NULL;
+  }
+  struct filedesc* filedesc = &fd_chunks[fd / FD_CHUNK_SIZE][fd % FD_CHUNK_SIZE];
+  return __atomic_load_n(&filedesc->file, __ATOMIC_ACQUIRE) == NULL ? NULL : filedesc;
+}
+
+struct block* create_block(unsigned char shift) {
+  struct block* block = pool_alloc(&block_pools[shift - BLOCK_SHIFT_MIN]);
+  if (block != NULL) {
+    block->refs = 1;
+    block->shift = shift;
+    block->image = false;
+  }
+  return block;
+}
+
+/** Drops a reference to the block, freeing it with the last one. */
+void put_block(struct block* block) {
+  if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0 && !block->image) {
+    pool_free(&block_pools[block->shift - BLOCK_SHIFT_MIN], block);
   }
-  return NULL;
 }
 
-struct block* create_block() {
-  struct block* block = malloc(sizeof(struct block));
+/**
+ * Returns block @a i of the file, which must be locked
+ * exclusively, ready to be changed. A block shared with read
+ * views is replaced with a copy first. A hole gets a new
+ * block, zeroed if @a zero is set.
+ * @retval NULL Not enough memory.
+ */
+struct block*
+writable_block(struct file* file, size_t i, bool zero) {
+  struct block* block = file->blocks[i];
   if (block == NULL) {
-    perror("malloc");
-    exit(EXIT_FAILURE);
+    block = create_block(file->block_shift);
+    if (block != NULL && zero) {
+      memset(block->memory, 0, (size_t)1 << file->block_shift);
+    }
+    file->blocks[i] = block;
+    return block;
   }
-  block->memory = malloc(BLOCK_SIZE);
-  if (block->memory == NULL) {
-    perror("malloc");
-    exit(EXIT_FAILURE);
+  if (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) == 1) {
+    return block;
   }
-  block->occupied = 0;
-  block->next = NULL;
-  block->prev = NULL;
-  return block;
+  struct block* copy = create_block(file->block_shift);
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy->memory, block->memory, (size_t)1 << file->block_shift);
+  file->blocks[i] = copy;
+  put_block(block);
+  return copy;
 }
 
-ssize_t
-write_to_block(
-    struct block* block, 
-    struct file* file,
-    int offset,
-    const char* buf, size_t size
-) {
-  if (size < 1) {
-    return size;
-  }
-  if (offset == MAX_FILE_SIZE) {
-    ufs_error_code = UFS_ERR_NO_MEM; 
-    return -1; 
+/**
+ * Makes the block table of the file span at least @a count
+ * blocks. New entries are holes, so growing takes no memory
+ * for the data. The table grows by doubling, so appending
+ * stays amortized O(1).
+ * @retval 0 Success.
+ * @retval -1 Not enough memory.
+ */
+int
+reserve_blocks(struct file* file, size_t count) {
+  if (count > file->block_capacity) {
+    size_t new_cap = file->block_capacity * 2;
+    if (new_cap < count) {
+      new_cap = count;
+    }
+    struct block** new_blocks = realloc(file->blocks, new_cap * sizeof(struct block*));
+    if (new_blocks == NULL) {
+      return -1;
+    }
+    file->blocks = new_blocks;
+    file->block_capacity = new_cap;
+  }
+  while (file->block_count < count) {
+    file->blocks[file->block_count++] = NULL;
   }
+  return 0;
+}
 
-  int mem_left = BLOCK_SIZE - offset % BLOCK_SIZE;
-  if (mem_left < size) {
-    memcpy(block->memory + offset % BLOCK_SIZE, buf, mem_left);
-    file->size += mem_left;
-    block->occupied = BLOCK_SIZE;
-    int next_size = size - mem_left;
-    if (block->next == NULL) {
-      struct block* nblock = create_block();
-      block->next = nblock;
-      nblock->prev = block;
-      block = nblock;
-      file->last_block = block;
-    } else {
-      block = block->next;
+/** Frees blocks of the file starting from @a count. */
+void
+release_blocks(struct file* file, size_t count) {
+  while (file->block_count > count) {
+    struct block* block = file->blocks[--file->block_count];
+    if (block != NULL) {
+      put_block(block);
     }
-    return mem_left + write_to_block(block, 
-        file, offset + mem_left, buf + mem_left, next_size);
   }
-  memcpy(block->memory + offset % BLOCK_SIZE, buf, size);
-  file->size += size;
-  if (offset % BLOCK_SIZE + size > block->occupied) {
-    block->occupied = offset % BLOCK_SIZE + size;
+}
+
+/**
+ * Fills bytes [from, to) of the file with zeros. Holes are
+ * zeros already and stay holes.
+ * @retval 0 Success.
+ * @retval -1 Not enough memory to copy a shared block.
+ */
+int
+zero_range(struct file* file, size_t from, size_t to) {
+  size_t block_size = (size_t)1 << file->block_shift;
+  while (from < to) {
+    size_t in_block = from & (block_size - 1);
+    size_t n = block_size - in_block;
+    if (n > to - from) {
+      n = to - from;
+    }
+    size_t i = from >> file->block_shift;
+    if (file->blocks[i] != NULL) {
+      struct block* block = writable_block(file, i, false);
+      if (block == NULL) {
+        return -1;
+      }
+      memset(block->memory + in_block, 0, n);
+    }
+    from += n;
   }
-  return size;
+  return 0;
 }
 
+/**
+ * Appends @a size bytes to the file, which must be locked
+ * exclusively and have room for them under the size limit. The
+ * tail block is filled first, then new blocks are taken from
+ * the pool APPEND_BATCH at a time and get one memcpy each.
+ * Nothing is zeroed, as bytes past the file size are undefined,
+ * so log-style writers go at the speed of memcpy.
+ */
 ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+file_append(struct file* file, const char *buf, size_t size)
 {
-  struct filedesc* filedesc = find_filedesc(fd); 
-  if (filedesc == NULL) {
-    ufs_error_code = UFS_ERR_NO_FILE;
-    return -1; 
+  unsigned char shift = file->block_shift;
+  size_t block_size = (size_t)1 << shift;
+  size_t offset = file->size;
+  if (reserve_blocks(file, (offset + size + block_size - 1) >> shift) == -1) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
   }
-  if ((filedesc->flag & (UFS_CREATE | UFS_WRITE_ONLY | UFS_READ_WRITE)) == 0) {
-    ufs_error_code = UFS_ERR_NO_PERMISSION;
+  size_t written = 0;
+  size_t in_block = offset & (block_size - 1);
+  if (in_block != 0) {
+    /* The tail block is a hole if a resize grew the file. */
+    struct block* block = writable_block(file, offset >> shift, true);
+    if (block == NULL) {
+      ufs_error_code = UFS_ERR_NO_MEM;
+      return -1;
+    }
+    written = block_size - in_block < size ? block_size - in_block : size;
+    memcpy(block->memory + in_block, buf, written);
+  }
+  while (written < size) {
+    struct block* batch[APPEND_BATCH];
+    size_t count = (size - written + block_size - 1) >> shift;
+    count = count < APPEND_BATCH ? count : APPEND_BATCH;
+    count = pool_alloc_batch(&block_pools[shift - BLOCK_SHIFT_MIN], (void **)batch, count);
+    if (count == 0) {
+      break;
+    }
+    for (size_t j = 0; j < count; ++j) {
+      batch[j]->refs = 1;
+      batch[j]->shift = shift;
+      batch[j]->image = false;
+      size_t n = block_size < size - written ? block_size : size - written;
+      /* Blocks past the file size are holes, see file_resize(). */
+      file->blocks[(offset + written) >> shift] = batch[j];
+      memcpy(batch[j]->memory, buf + written, n);
+      written += n;
+    }
+  }
+  file->size = offset + written;
+  if (written == 0) {
+    ufs_error_code = UFS_ERR_NO_MEM;
     return -1;
   }
-  struct file* file = filedesc->file;
-  int block_id = filedesc->offset / BLOCK_SIZE;
-  int offset = filedesc->offset;
+  return written;
+}
 
-  if (file->block_list == NULL) {
-    struct block* block = create_block();
-    file->block_list = block;
-    file->last_block = block;
+/**
+ * Writes @a size bytes at @a offset of the file, which must be
+ * locked exclusively. A write crossing the file size limit is
+ * cut. A gap between the end of the file and @a offset reads
+ * as zeros, whole blocks of it stay holes. A write at the end
+ * of the file takes the append path.
+ */
+ssize_t
+file_write(struct file* file, size_t offset, const char *buf, size_t size)
+{
+  if (size == 0) {
+    return 0;
+  }
+  size_t max_size = __atomic_load_n(&max_file_size, __ATOMIC_RELAXED);
+  if (offset >= max_size) {
+    ufs_error_code = UFS_ERR_NO_MEM; 
+    return -1; 
   }
-  struct block* block = file->block_list;
-  for (int i = 0; i < block_id && block != NULL; ++i) {
-    block = block->next; 
+  if (size > max_size - offset) {
+    size = max_size - offset;
   }
-  if (block == NULL) {
-    block = create_block();
-    block->prev = file->last_block;
-    file->last_block->next = block;
-    file->last_block = block;
+  if (offset == file->size) {
+    return file_append(file, buf, size);
+  }
+  size_t block_size = (size_t)1 << file->block_shift;
+  if (reserve_blocks(file, (offset + size + block_size - 1) >> file->block_shift) == -1) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
   }
-  ssize_t bytes_read = write_to_block(block, file, offset, buf, size); 
-  if (bytes_read != -1) {
-    filedesc->offset += bytes_read;
+  if (offset > file->size && zero_range(file, file->size, offset) == -1) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  size_t written = 0;
+  while (written < size) {
+    size_t in_block = offset & (block_size - 1);
+    size_t n = block_size - in_block;
+    if (n > size - written) {
+      n = size - written;
+    }
+    /* A hole filled only in part must read as zeros around. */
+    bool zero = in_block != 0 || offset + n < file->size;
+    struct block* block = writable_block(file, offset >> file->block_shift, zero);
+    if (block == NULL) {
+      break;
+    }
+    memcpy(block->memory + in_block, buf + written, n);
+    written += n;
+    offset += n;
   }
-  return bytes_read;
+  if (offset > file->size) {
+    file->size = offset;
+  }
+  if (written == 0) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  return written;
 }
 
-ssize_t 
-read_from_block(struct block* block, int offset, char* buf, size_t size) {
-  if (block == NULL) {
+/**
+ * Reads up to @a size bytes at @a offset of the file, which
+ * must be locked at least shared.
+ */
+ssize_t
+file_read(struct file* file, size_t offset, char *buf, size_t size)
+{
+  if (offset >= file->size) {
     return 0;
   }
-  int eff_size = block->occupied - offset;
-  if (eff_size >= size) {
-    memcpy(buf, block->memory + offset, size);
-    return size;
+  if (size > file->size - offset) {
+    size = file->size - offset;
   }
-  memcpy(buf, block->memory + offset, eff_size);
-  if (block->occupied == BLOCK_SIZE) {
-    int bytes_left = size - eff_size;
-    return eff_size + read_from_block(block->next, 0, buf + eff_size, bytes_left);
+  size_t block_size = (size_t)1 << file->block_shift;
+  size_t read_bytes = 0;
+  while (read_bytes < size) {
+    struct block* block = file->blocks[offset >> file->block_shift];
+    size_t in_block = offset & (block_size - 1);
+    size_t n = block_size - in_block;
+    if (n > size - read_bytes) {
+      n = size - read_bytes;
+    }
+    if (block == NULL) {
+      memset(buf + read_bytes, 0, n);
+    } else {
+      memcpy(buf + read_bytes, block->memory + in_block, n);
+    }
+    read_bytes += n;
+    offset += n;
   }
-  return eff_size;
+  return read_bytes;
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size)
-{
-  struct filedesc* filedesc = find_filedesc(fd); 
+/**
+ * Finds the descriptor and checks that it allows the access
+ * given by @a rights, a mask of open flags.
+ */
+struct filedesc*
+access_filedesc(int fd, int rights) {
+  struct filedesc* filedesc = find_filedesc(fd);
   if (filedesc == NULL) {
     ufs_error_code = UFS_ERR_NO_FILE;
-    return -1; 
+    return NULL;
   }
-  if ((filedesc->flag & (UFS_READ_WRITE | UFS_READ_ONLY | UFS_CREATE)) == 0) {
+  if ((filedesc->flag & rights) == 0) {
     ufs_error_code = UFS_ERR_NO_PERMISSION;
+    return NULL;
+  }
+  return filedesc;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+  struct filedesc* filedesc = access_filedesc(fd, WRITE_RIGHTS);
+  if (filedesc == NULL) {
     return -1;
   }
   struct file* file = filedesc->file;
-  int block_id = filedesc->offset / BLOCK_SIZE;
-  int offset = filedesc->offset % BLOCK_SIZE;
-  
-  struct block* block = file->block_list;
-  for (int i = 0; i < block_id && block != NULL; ++i) {
-    block = block->next;
+  pthread_rwlock_wrlock(&file->lock);
+  if (filedesc->flag & UFS_APPEND) {
+    filedesc->offset = file->size;
   }
-  if (block == NULL) {
-    return 0;
+  ssize_t written = file_write(file, filedesc->offset, buf, size);
+  if (written > 0) {
+    filedesc->offset += written;
   }
-  ssize_t read_bytes = read_from_block(block, offset, buf, size);
-  if (read_bytes != -1) {
-    filedesc->offset += read_bytes;
+  pthread_rwlock_unlock(&file->lock);
+  return written;
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+  struct filedesc* filedesc = access_filedesc(fd, READ_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
   }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  ssize_t read_bytes = file_read(file, filedesc->offset, buf, size);
+  filedesc->offset += read_bytes;
+  pthread_rwlock_unlock(&file->lock);
   return read_bytes;
 }
 
-void free_blocks(struct block* head) {
-  struct block* next;
-  while (head != NULL) {
-    next = head ->next;
-    free(head->memory);
-    free(head);
-    head = next;
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+  struct filedesc* filedesc = access_filedesc(fd, WRITE_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
   }
+  struct file* file = filedesc->file;
+  pthread_rwlock_wrlock(&file->lock);
+  ssize_t written = file_write(file, offset, buf, size);
+  pthread_rwlock_unlock(&file->lock);
+  return written;
 }
 
-void free_file(struct file* file) {
-  struct block* block = file->block_list;
-  free_blocks(block);
-  free((char*) file->name);
-  free(file);
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+  struct filedesc* filedesc = access_filedesc(fd, READ_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  ssize_t read_bytes = file_read(file, offset, buf, size);
+  pthread_rwlock_unlock(&file->lock);
+  return read_bytes;
 }
 
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct filedesc* filedesc = access_filedesc(fd, WRITE_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_wrlock(&file->lock);
+  if (filedesc->flag & UFS_APPEND) {
+    filedesc->offset = file->size;
+  }
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    ssize_t written = file_write(file, filedesc->offset, iov[i].iov_base, iov[i].iov_len);
+    if (written == -1) {
+      total = total == 0 ? -1 : total;
+      break;
+    }
+    filedesc->offset += written;
+    total += written;
+    if ((size_t)written < iov[i].iov_len) {
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&file->lock);
+  return total;
+}
 
-bool
-exists(struct file* file) {
-  struct file* cur = file_list;
-  while (cur != NULL) {
-    if (cur == file) {
-      return true;
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct filedesc* filedesc = access_filedesc(fd, READ_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    ssize_t read_bytes = file_read(file, filedesc->offset, iov[i].iov_base, iov[i].iov_len);
+    filedesc->offset += read_bytes;
+    total += read_bytes;
+    if ((size_t)read_bytes < iov[i].iov_len) {
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&file->lock);
+  return total;
+}
+
+/**
+ * Finds the first data, or hole if @a data is not set, at or
+ * after @a offset in the file, which must be locked at least
+ * shared. The end of the file is a hole.
+ * @retval -1 Nothing found, or the offset is not in the file.
+ */
+off_t
+file_seek_extent(struct file* file, size_t offset, bool data) {
+  if (offset >= file->size) {
+    return -1;
+  }
+  size_t count = (file->size + ((size_t)1 << file->block_shift) - 1) >> file->block_shift;
+  size_t i = offset >> file->block_shift;
+  while (i < count && (file->blocks[i] != NULL) != data) {
+    ++i;
+  }
+  if (i == count) {
+    return data ? -1 : (off_t)file->size;
+  }
+  size_t start = i << file->block_shift;
+  return start > offset ? start : offset;
+}
+
+/**
+ * Resolves a ufs_lseek() offset against the descriptor position
+ * and the file. The file must be locked at least shared.
+ * @retval -1 The position is negative or there is no extent.
+ */
+static off_t
+filedesc_seek(struct filedesc* filedesc, off_t offset, int whence)
+{
+  struct file* file = filedesc->file;
+  switch (whence) {
+  case UFS_SEEK_SET:
+    return offset;
+  case UFS_SEEK_CUR:
+    return (off_t)filedesc->offset + offset;
+  case UFS_SEEK_END:
+    return (off_t)file->size + offset;
+  case UFS_SEEK_DATA:
+  case UFS_SEEK_HOLE:
+    if (offset >= 0) {
+      return file_seek_extent(file, offset, whence == UFS_SEEK_DATA);
     }
-    cur = cur->next;
+    break;
+  }
+  return -1;
+}
+
+off_t
+ufs_lseek(int fd, off_t offset, int whence)
+{
+  struct filedesc* filedesc = find_filedesc(fd);
+  if (filedesc == NULL) {
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  off_t pos = filedesc_seek(filedesc, offset, whence);
+  if (pos >= 0) {
+    filedesc->offset = pos;
+  }
+  pthread_rwlock_unlock(&file->lock);
+  if (pos < 0) {
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+  }
+  return pos;
+}
+
+off_t
+ufs_pseek(int fd, off_t offset, int whence)
+{
+  struct filedesc* filedesc = find_filedesc(fd);
+  if (filedesc == NULL) {
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  off_t pos = filedesc_seek(filedesc, offset, whence);
+  pthread_rwlock_unlock(&file->lock);
+  if (pos < 0) {
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+  }
+  return pos;
+}
+
+/**
+ * Fills @a view with the data at @a offset up to the end of its
+ * block. The file must be locked at least shared.
+ */
+static void
+file_view(struct file* file, size_t offset, struct ufs_view *view)
+{
+  if (offset >= file->size) {
+    return;
+  }
+  size_t block_size = (size_t)1 << file->block_shift;
+  struct block* block = file->blocks[offset >> file->block_shift];
+  size_t in_block = offset & (block_size - 1);
+  size_t n = block_size - in_block;
+  if (n > file->size - offset) {
+    n = file->size - offset;
+  }
+  if (block == NULL) {
+    view->data = zero_block + in_block;
+  } else {
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_ACQ_REL);
+    view->data = block->memory + in_block;
+  }
+  view->size = n;
+  view->block = block;
+}
+
+ssize_t
+ufs_read_view(int fd, struct ufs_view *view)
+{
+  view->data = NULL;
+  view->size = 0;
+  view->block = NULL;
+  struct filedesc* filedesc = access_filedesc(fd, READ_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
   }
-  return false;
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  file_view(file, filedesc->offset, view);
+  filedesc->offset += view->size;
+  pthread_rwlock_unlock(&file->lock);
+  return view->size;
 }
 
+ssize_t
+ufs_pread_view(int fd, struct ufs_view *view, size_t offset)
+{
+  view->data = NULL;
+  view->size = 0;
+  view->block = NULL;
+  struct filedesc* filedesc = access_filedesc(fd, READ_RIGHTS);
+  if (filedesc == NULL) {
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_rdlock(&file->lock);
+  file_view(file, offset, view);
+  pthread_rwlock_unlock(&file->lock);
+  return view->size;
+}
+
+void
+ufs_release_view(struct ufs_view *view)
+{
+  if (view->block != NULL) {
+    put_block(view->block);
+  }
+  view->data = NULL;
+  view->size = 0;
+  view->block = NULL;
+}
+
+void free_file(struct file* file) {
+  release_blocks(file, 0);
+  free(file->blocks);
+  pthread_rwlock_destroy(&file->lock);
+  free((char*) file->name);
+  pool_free(&file_pool, file);
+}
+
+
 int
 ufs_close(int fd)
 {
-  for (int i = 0; i < file_descriptor_count; ++i) {
-    if (file_descriptors[i] != NULL && file_descriptors[i]->id == fd) {
-      struct file* file = file_descriptors[i]->file;
-      if(--file->refs == 0 && !exists(file)) {
-        free_file(file); 
+  struct filedesc* filedesc = find_filedesc(fd);
+  if (filedesc == NULL) {
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  pthread_rwlock_rdlock(&index_lock);
+  struct file* file = filedesc->file;
+  pthread_rwlock_wrlock(&file->lock);
+  if (filedesc->next != NULL) {
+    filedesc->next->prev = filedesc->prev;
+  }
+  if (filedesc->prev != NULL) {
+    filedesc->prev->next = filedesc->next;
+  } else {
+    file->descriptors = filedesc->next;
+  }
+  bool last = --file->refs == 0 && file->unlinked;
+  pthread_rwlock_unlock(&file->lock);
+  __atomic_store_n(&filedesc->file, NULL, __ATOMIC_RELEASE);
+  if (last) {
+    free_file(file); 
+  }
+  pthread_rwlock_unlock(&index_lock);
+  put_fd(fd);
+  return 0;
+}
+
+
+/** Takes the file out of its directory. */
+void
+unlink_child(struct file* file) {
+  if (file->next_sibling != NULL) {
+    file->next_sibling->prev_sibling = file->prev_sibling;
+  }
+  if (file->prev_sibling != NULL) {
+    file->prev_sibling->next_sibling = file->next_sibling;
+  } else {
+    file->parent->children = file->next_sibling;
+  }
+}
+
+int
+ufs_delete(const char *filename)
+{
+  filename = skip_root(filename);
+  pthread_rwlock_wrlock(&index_lock);
+  size_t slot = 0;
+  if (file_count == 0 ||
+      file_index[slot = index_slot(filename, hash_name(filename))] == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  struct file* file = file_index[slot];
+  if (file->children != NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_NOT_EMPTY;
+    return -1;
+  }
+  index_remove(slot);
+  unlink_child(file);
+  file->unlinked = true;
+  if (file->refs == 0) {
+    free_file(file);
+  }
+  pthread_rwlock_unlock(&index_lock);
+  return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+  path = skip_root(path);
+  pthread_rwlock_wrlock(&index_lock);
+  int rc = 0;
+  struct file* parent = NULL;
+  if (find_file(path) != NULL) {
+    ufs_error_code = UFS_ERR_EXISTS;
+    rc = -1;
+  } else if ((parent = find_parent(path)) == NULL) {
+    ufs_error_code = UFS_ERR_NO_FILE;
+    rc = -1;
+  } else {
+    create_file(path, parent)->is_dir = true;
+  }
+  pthread_rwlock_unlock(&index_lock);
+  return rc;
+}
+
+/**
+ * Opened directory. It holds copies of the names the directory
+ * had when opened, so reading it takes no locks and changes of
+ * the directory do not disturb it.
+ */
+struct ufs_dir {
+  char **names;
+  size_t count;
+  size_t pos;
+};
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+  path = skip_root(path);
+  pthread_rwlock_rdlock(&index_lock);
+  struct file* dir = path[0] == '\0' ? &root_dir : find_file(path);
+  if (dir == NULL || !dir->is_dir) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = dir == NULL ? UFS_ERR_NO_FILE : UFS_ERR_NOT_DIR;
+    return NULL;
+  }
+  struct ufs_dir *result = malloc(sizeof(*result));
+  size_t count = 0;
+  for (struct file* child = dir->children; child != NULL; child = child->next_sibling) {
+    ++count;
+  }
+  char **names = malloc((count + 1) * sizeof(char *));
+  if (result == NULL || names == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    free(names);
+    free(result);
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return NULL;
+  }
+  result->names = names;
+  result->count = 0;
+  result->pos = 0;
+  for (struct file* child = dir->children; child != NULL; child = child->next_sibling) {
+    const char* slash = strrchr(child->name, '/');
+    char* name = strdup(slash == NULL ? child->name : slash + 1);
+    if (name == NULL) {
+      pthread_rwlock_unlock(&index_lock);
+      ufs_closedir(result);
+      ufs_error_code = UFS_ERR_NO_MEM;
+      return NULL;
+    }
+    names[result->count++] = name;
+  }
+  pthread_rwlock_unlock(&index_lock);
+  return result;
+}
+
+const char *
+ufs_readdir(struct ufs_dir *dir)
+{
+  return dir->pos < dir->count ? dir->names[dir->pos++] : NULL;
+}
+
+void
+ufs_closedir(struct ufs_dir *dir)
+{
+  for (size_t i = 0; i < dir->count; ++i) {
+    free(dir->names[i]);
+  }
+  free(dir->names);
+  free(dir);
+}
+
+/**
+ * Moves descriptors of the file which are beyond its end to
+ * the end. Only the descriptors of this file are visited.
+ */
+void update_fildescs(struct file* file) {
+  size_t size = file->size;
+  for (struct filedesc* fd = file->descriptors; fd != NULL; fd = fd->next) {
+    fd->offset = fd->offset > size ? size : fd->offset;
+  }
+}
+
+/**
+ * Resizes the file, which must be locked exclusively. Growth
+ * only extends the block table with holes.
+ */
+int
+file_resize(struct file* file, size_t new_size) {
+  if (new_size > __atomic_load_n(&max_file_size, __ATOMIC_RELAXED)) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  size_t block_size = (size_t)1 << file->block_shift;
+  size_t blocks = (new_size + block_size - 1) >> file->block_shift;
+  if (new_size <= file->size) {
+    release_blocks(file, blocks);
+    file->size = new_size;
+    update_fildescs(file);
+    return 0;
+  }
+  if (reserve_blocks(file, blocks) == -1) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  /* The tail may hold bytes of an earlier shrink. */
+  if (zero_range(file, file->size, new_size) == -1) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  file->size = new_size;
+  return 0;
+}
+
+int 
+ufs_resize(int fd, size_t new_size) {
+  struct filedesc* filedesc = find_filedesc(fd);
+  if (filedesc == NULL) {
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  struct file* file = filedesc->file;
+  pthread_rwlock_wrlock(&file->lock);
+  int rc = file_resize(file, new_size);
+  pthread_rwlock_unlock(&file->lock);
+  return rc;
+}
+
+/**
+ * Image of the file system in its backing file. The superblock
+ * is followed by the data area and the inode table. The data
+ * area holds blocks in their memory layout, header included,
+ * so a mapped image is used in place: loading it reads only
+ * the inode table, however much data there is. An inode is a
+ * struct image_inode, the file name padded to 8 bytes and the
+ * extents of the file, runs of its blocks stored one after
+ * another. Blocks not in any extent are holes. A directory
+ * comes before the files in it.
+ */
+enum {
+  IMAGE_VERSION = 2,
+  /** Inode flag of a directory. */
+  IMAGE_INODE_DIR = 1,
+  /** Offset of the data area, leaves a page to the superblock. */
+  IMAGE_DATA_OFFSET = 4096,
+};
+
+static const char image_magic[8] = "UFSIMAGE";
+
+struct image_super {
+  char magic[8];
+  uint32_t version;
+  /** Size of the block header, images of other builds differ. */
+  uint32_t block_header;
+  uint64_t file_count;
+  uint64_t inode_offset;
+  uint64_t size;
+};
+
+struct image_inode {
+  uint64_t size;
+  uint64_t extent_count;
+  uint32_t name_len;
+  uint32_t block_shift;
+  uint64_t flags;
+};
+
+struct image_extent {
+  /** First block of the run in the file. */
+  uint64_t block;
+  uint64_t count;
+  /** Offset of the first block in the image. */
+  uint64_t offset;
+};
+
+/** Backing file set by ufs_mount(), guarded by index_lock. */
+static char *image_path = NULL;
+/** Size of the mapped image. */
+static size_t image_size = 0;
+/**
+ * Serializes ufs_sync() calls, which hold index_lock shared and
+ * all write the same temporary file.
+ */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Growing buffer the inode table is built in. */
+struct image_buf {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+static int
+image_buf_put(struct image_buf *buf, const void *data, size_t size)
+{
+  size_t padded = (size + 7) & ~(size_t)7;
+  if (buf->size + padded > buf->capacity) {
+    size_t new_cap = buf->capacity * 2;
+    if (new_cap < buf->size + padded) {
+      new_cap = buf->size + padded + 4096;
+    }
+    char *new_data = realloc(buf->data, new_cap);
+    if (new_data == NULL) {
+      return -1;
+    }
+    buf->data = new_data;
+    buf->capacity = new_cap;
+  }
+  memcpy(buf->data + buf->size, data, size);
+  memset(buf->data + buf->size + size, 0, padded - size);
+  buf->size += padded;
+  return 0;
+}
+
+static int
+write_all(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct iovec rest[3];
+  memcpy(rest, iov, iovcnt * sizeof(*iov));
+  for (int i = 0; i < iovcnt;) {
+    ssize_t rc = writev(fd, rest + i, iovcnt - i);
+    if (rc < 0) {
+      return -1;
+    }
+    for (; i < iovcnt && (size_t)rc >= rest[i].iov_len; ++i) {
+      rc -= rest[i].iov_len;
+    }
+    if (i < iovcnt) {
+      rest[i].iov_base = (char *)rest[i].iov_base + rc;
+      rest[i].iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Fills @a header with the header every block of an image is
+ * written with. Loading checks the headers against it, as they
+ * are used in place and a wrong one would free image memory to
+ * a pool or share a block without copying it.
+ */
+static void
+image_block_header(struct block *header, unsigned char shift)
+{
+  memset(header, 0, sizeof(*header));
+  header->refs = 1;
+  header->shift = shift;
+  header->image = true;
+}
+
+/**
+ * Writes the blocks of the file, which must be locked at least
+ * shared, at @a offset of the image and adds its inode to
+ * @a inodes. Moves @a offset past the blocks.
+ */
+static int
+image_write_file(int fd, struct file *file, uint64_t *offset, struct image_buf *inodes)
+{
+  size_t block_size = (size_t)1 << file->block_shift;
+  size_t count = (file->size + block_size - 1) >> file->block_shift;
+  struct image_buf extents = {NULL, 0, 0};
+  struct block header;
+  image_block_header(&header, file->block_shift);
+  int rc = 0;
+  for (size_t i = 0; i < count && rc == 0;) {
+    if (file->blocks[i] == NULL) {
+      ++i;
+      continue;
+    }
+    struct image_extent extent = {i, 0, *offset};
+    for (; i < count && file->blocks[i] != NULL; ++i, ++extent.count) {
+      /*
+       * Pool blocks are recycled, so the tail of the last block
+       * past the size may hold data of a deleted file.
+       */
+      size_t used = file->size - ((uint64_t)i << file->block_shift);
+      used = used < block_size ? used : block_size;
+      struct iovec iov[3] = {
+        {&header, sizeof(header)}, {file->blocks[i]->memory, used},
+        {zero_block, block_size - used},
+      };
+      if (write_all(fd, iov, 3) == -1) {
+        rc = -1;
+        break;
       }
-      free(file_descriptors[i]);
-      file_descriptors[i] = NULL;
-      return 0;
+      *offset += sizeof(header) + block_size;
     }
+    rc = rc == 0 ? image_buf_put(&extents, &extent, sizeof(extent)) : rc;
   }
-  ufs_error_code = UFS_ERR_NO_FILE;
-  return -1;
+  struct image_inode inode = {
+    file->size, extents.size / sizeof(struct image_extent),
+    strlen(file->name), file->block_shift,
+    file->is_dir ? IMAGE_INODE_DIR : 0,
+  };
+  if (rc == 0) {
+    rc = image_buf_put(inodes, &inode, sizeof(inode));
+  }
+  if (rc == 0) {
+    rc = image_buf_put(inodes, file->name, inode.name_len);
+  }
+  if (rc == 0 && extents.size > 0) {
+    rc = image_buf_put(inodes, extents.data, extents.size);
+  }
+  free(extents.data);
+  return rc;
 }
 
+/**
+ * Returns the file after @a file in a walk of the whole tree,
+ * which visits a directory before the files in it. The walk
+ * starts from the root. index_lock must be locked.
+ */
+static struct file *
+next_in_tree(struct file *file)
+{
+  if (file->children != NULL) {
+    return file->children;
+  }
+  while (file != &root_dir && file->next_sibling == NULL) {
+    file = file->parent;
+  }
+  return file == &root_dir ? NULL : file->next_sibling;
+}
 
 int
-ufs_delete(const char *filename)
+ufs_sync(void)
 {
-  struct file* file = find_file(filename);
-  if (file != NULL) {
-    if (file->next != NULL) {
-      file->next->prev = file->prev;
+  pthread_mutex_lock(&sync_lock);
+  pthread_rwlock_rdlock(&index_lock);
+  if (image_path == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&sync_lock);
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+  }
+  size_t path_len = strlen(image_path);
+  char *tmp_path = malloc(path_len + 5);
+  if (tmp_path == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&sync_lock);
+    ufs_error_code = UFS_ERR_NO_MEM;
+    return -1;
+  }
+  memcpy(tmp_path, image_path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int rc = fd == -1 || lseek(fd, IMAGE_DATA_OFFSET, SEEK_SET) == -1 ? -1 : 0;
+  struct image_buf inodes = {NULL, 0, 0};
+  uint64_t offset = IMAGE_DATA_OFFSET;
+  for (struct file *file = next_in_tree(&root_dir); file != NULL && rc == 0;
+       file = next_in_tree(file)) {
+    pthread_rwlock_rdlock(&file->lock);
+    rc = image_write_file(fd, file, &offset, &inodes);
+    pthread_rwlock_unlock(&file->lock);
+  }
+  struct image_super super;
+  memset(&super, 0, sizeof(super));
+  memcpy(super.magic, image_magic, sizeof(super.magic));
+  super.version = IMAGE_VERSION;
+  super.block_header = sizeof(struct block);
+  super.file_count = file_count;
+  super.inode_offset = offset;
+  super.size = offset + inodes.size;
+  if (rc == 0) {
+    struct iovec iov = {inodes.data, inodes.size};
+    rc = write_all(fd, &iov, 1);
+  }
+  if (rc == 0 && (pwrite(fd, &super, sizeof(super), 0) != sizeof(super) ||
+      fsync(fd) == -1)) {
+    rc = -1;
+  }
+  if (fd != -1 && close(fd) == -1) {
+    rc = -1;
+  }
+  if (rc == 0 && rename(tmp_path, image_path) == -1) {
+    rc = -1;
+  }
+  if (rc == -1 && fd != -1) {
+    unlink(tmp_path);
+  }
+  pthread_rwlock_unlock(&index_lock);
+  pthread_mutex_unlock(&sync_lock);
+  free(inodes.data);
+  free(tmp_path);
+  if (rc == -1) {
+    ufs_error_code = UFS_ERR_IO;
+  }
+  return rc;
+}
+
+/**
+ * Creates the files of a mapped image, with blocks pointing
+ * into it. index_lock must be locked exclusively. Nothing read
+ * from the image is trusted before it is checked.
+ * @retval -1 The image is damaged.
+ */
+static int
+image_load(char *image, size_t size)
+{
+  const struct image_super *super = (const struct image_super *)image;
+  if (size < IMAGE_DATA_OFFSET || memcmp(super->magic, image_magic, sizeof(super->magic)) != 0 ||
+      super->version != IMAGE_VERSION || super->block_header != sizeof(struct block) ||
+      super->size != size || super->inode_offset > size || super->inode_offset % 8 != 0) {
+    return -1;
+  }
+  size_t pos = super->inode_offset;
+  uint64_t data_end = IMAGE_DATA_OFFSET;
+  for (uint64_t n = 0; n < super->file_count; ++n) {
+    struct image_inode inode;
+    if (size - pos < sizeof(inode)) {
+      return -1;
     }
-    if (file->prev != NULL) {
-      file->prev->next = file->next;
+    memcpy(&inode, image + pos, sizeof(inode));
+    pos += sizeof(inode);
+    size_t name_size = (inode.name_len + 7) & ~(size_t)7;
+    if (inode.block_shift < BLOCK_SHIFT_MIN || inode.block_shift > BLOCK_SHIFT_MAX ||
+        size - pos < name_size || (size - pos - name_size) / sizeof(struct image_extent) <
+        inode.extent_count) {
+      return -1;
     }
-    if (file == file_list) {
-      file_list = file->next;
+    char *name = strndup(image + pos, inode.name_len);
+    if (name == NULL) {
+      return -1;
     }
-    if (file->refs == 0) {
-      free_file(file);
+    pos += name_size;
+    struct file *parent = find_parent(name);
+    if (parent == NULL || find_file(name) != NULL) {
+      free(name);
+      return -1;
+    }
+    struct file *file = create_file(name, parent);
+    file->is_dir = (inode.flags & IMAGE_INODE_DIR) != 0;
+    free(name);
+    if (file->is_dir && (inode.size != 0 || inode.extent_count != 0)) {
+      return -1;
+    }
+    /* A bigger size would also overflow the block count. */
+    if (inode.size > __atomic_load_n(&max_file_size, __ATOMIC_RELAXED)) {
+      return -1;
+    }
+    file->block_shift = inode.block_shift;
+    size_t block_size = (size_t)1 << inode.block_shift;
+    size_t slot = sizeof(struct block) + block_size;
+    size_t count = (inode.size + block_size - 1) >> inode.block_shift;
+    if (reserve_blocks(file, count) == -1) {
+      return -1;
+    }
+    struct block header;
+    image_block_header(&header, inode.block_shift);
+    file->size = inode.size;
+    for (uint64_t e = 0; e < inode.extent_count; ++e) {
+      struct image_extent extent;
+      memcpy(&extent, image + pos, sizeof(extent));
+      pos += sizeof(extent);
+      /*
+       * Blocks are written one after another, so extents come in
+       * increasing order and a block is never in two of them.
+       */
+      if (extent.block > count || extent.count > count - extent.block ||
+          extent.offset < data_end || extent.offset > super->inode_offset ||
+          extent.offset % _Alignof(struct block) != 0 ||
+          (super->inode_offset - extent.offset) / slot < extent.count) {
+        return -1;
+      }
+      for (uint64_t i = 0; i < extent.count; ++i) {
+        struct block *block = (struct block *)(image + extent.offset + i * slot);
+        if (memcmp(block, &header, sizeof(header)) != 0) {
+          return -1;
+        }
+        file->blocks[extent.block + i] = block;
+      }
+      data_end = extent.offset + extent.count * slot;
     }
-    return 0;
   }
-  ufs_error_code = UFS_ERR_NO_FILE;
-  return -1;
+  return 0;
 }
 
-void update_fildescs(struct file* file) {
-  int size = file->size;
-  struct filedesc* fd = NULL;
-  for (int i = 0; i < file_descriptor_count; ++i) {
-    fd = file_descriptors[i];
-    if (fd != NULL && fd->file == file) {
-      fd->offset = fd->offset > size ? size : fd->offset;
+int
+ufs_mount(const char *path)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  int rc = 0;
+  if (file_count != 0) {
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    rc = -1;
+  }
+  char *path_copy = rc == 0 ? strdup(path) : NULL;
+  if (rc == 0 && path_copy == NULL) {
+    ufs_error_code = UFS_ERR_NO_MEM;
+    rc = -1;
+  }
+  int fd = rc == 0 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+  /* Only a missing image means an empty file system. */
+  struct stat st;
+  if (rc == 0 && ((fd == -1 && errno != ENOENT) ||
+      (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))))) {
+    ufs_error_code = UFS_ERR_IO;
+    rc = -1;
+  } else if (fd != -1 && st.st_size > 0) {
+    void *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED || image_load(image, st.st_size) == -1) {
+      /* Drop whatever was loaded before the damage was found. */
+      for (size_t i = 0; i < file_index_capacity; ++i) {
+        if (file_index[i] != NULL) {
+          free_file(file_index[i]);
+          file_index[i] = NULL;
+        }
+      }
+      file_count = 0;
+      root_dir.children = NULL;
+      if (image != MAP_FAILED) {
+        munmap(image, st.st_size);
+      }
+      ufs_error_code = UFS_ERR_IO;
+      rc = -1;
+    } else {
+      __atomic_add_fetch(&image_size, st.st_size, __ATOMIC_RELAXED);
     }
   }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (rc == 0) {
+    free(image_path);
+    image_path = path_copy;
+  } else {
+    free(path_copy);
+  }
+  pthread_rwlock_unlock(&index_lock);
+  return rc;
 }
 
-int 
-ufs_resize(int fd, size_t new_size) {
-  if (new_size < 0) {
+int
+ufs_clone(const char *src, const char *dst)
+{
+  src = skip_root(src);
+  dst = skip_root(dst);
+  pthread_rwlock_wrlock(&index_lock);
+  struct file* from = find_file(src);
+  if (from == NULL) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_NO_FILE;
+    return -1;
+  }
+  struct file* to = find_file(dst);
+  if (to == from) {
+    pthread_rwlock_unlock(&index_lock);
+    return 0;
+  }
+  if (from->is_dir || (to != NULL && to->is_dir)) {
+    pthread_rwlock_unlock(&index_lock);
+    ufs_error_code = UFS_ERR_IS_DIR;
     return -1;
   }
+  if (to == NULL) {
+    struct file* parent = find_parent(dst);
+    if (parent == NULL) {
+      pthread_rwlock_unlock(&index_lock);
+      ufs_error_code = UFS_ERR_NO_FILE;
+      return -1;
+    }
+    to = create_file(dst, parent);
+  }
+  /*
+   * Two file locks are safe to hold: every other path takes
+   * at most one, and clones are serialized by index_lock.
+   */
+  pthread_rwlock_rdlock(&from->lock);
+  pthread_rwlock_wrlock(&to->lock);
+  release_blocks(to, 0);
+  to->block_shift = from->block_shift;
+  size_t count = (from->size + ((size_t)1 << from->block_shift) - 1) >> from->block_shift;
+  int rc = reserve_blocks(to, count);
+  if (rc == 0) {
+    for (size_t i = 0; i < count; ++i) {
+      struct block* block = from->blocks[i];
+      if (block != NULL) {
+        __atomic_add_fetch(&block->refs, 1, __ATOMIC_ACQ_REL);
+      }
+      to->blocks[i] = block;
+    }
+    to->size = from->size;
+  } else {
+    to->size = 0;
+    ufs_error_code = UFS_ERR_NO_MEM;
+  }
+  update_fildescs(to);
+  pthread_rwlock_unlock(&to->lock);
+  pthread_rwlock_unlock(&from->lock);
+  pthread_rwlock_unlock(&index_lock);
+  return rc;
+}
+
+int
+ufs_set_block_size(int fd, size_t block_size)
+{
   struct filedesc* filedesc = find_filedesc(fd);
   if (filedesc == NULL) {
     ufs_error_code = UFS_ERR_NO_FILE;
     return -1;
   }
+  unsigned char shift = BLOCK_SHIFT_MIN;
+  while (shift < BLOCK_SHIFT_MAX && ((size_t)1 << shift) < block_size) {
+    ++shift;
+  }
+  if (((size_t)1 << shift) != block_size) {
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+  }
   struct file* file = filedesc->file;
-  int new_blocks = new_size / BLOCK_SIZE - file->size / BLOCK_SIZE;
-  int offset = new_size % BLOCK_SIZE;
-  struct block* block = file->last_block;
-  if (new_blocks > 0) {
-    for (int i = 0; i < new_blocks; ++i) {
-      struct block* nblock = create_block();
-      nblock->prev = block;
-      block->next = nblock;
-      block = nblock;
-      file->size += BLOCK_SIZE;
-    }
-    file->last_block = block;
-    return 0;
-  } 
-  
-  for (int i = -1; i > new_blocks && block != NULL; --i) { 
-    block = block->prev;
-    file->size -= BLOCK_SIZE;
+  pthread_rwlock_wrlock(&file->lock);
+  int rc = 0;
+  if (file->size != 0) {
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    rc = -1;
+  } else {
+    release_blocks(file, 0);
+    file->block_shift = shift;
   }
-  if (block != NULL) {
-    block->occupied = offset;
-    file->size += offset - BLOCK_SIZE;
-    update_fildescs(file);
+  pthread_rwlock_unlock(&file->lock);
+  return rc;
+}
+
+void
+ufs_set_max_file_size(size_t size)
+{
+  __atomic_store_n(&max_file_size, size, __ATOMIC_RELAXED);
+}
+
+void
+ufs_get_stats(struct ufs_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i <= BLOCK_SHIFT_MAX - BLOCK_SHIFT_MIN; ++i) {
+    struct pool *pool = &block_pools[i];
+    pthread_mutex_lock(&pool->lock);
+    stats->mapped_bytes += pool->mapped;
+    stats->block_bytes += pool->used << (BLOCK_SHIFT_MIN + i);
+    stats->blocks_used += pool->used;
+    stats->blocks_free += pool->free;
+    pthread_mutex_unlock(&pool->lock);
   }
-  file->last_block = block;
-  return 0;
+  stats->mapped_bytes += __atomic_load_n(&image_size, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&file_pool.lock);
+  stats->mapped_bytes += file_pool.mapped;
+  stats->files = file_pool.used;
+  pthread_mutex_unlock(&file_pool.lock);
 }
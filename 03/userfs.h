@@ -1,10 +1,18 @@
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * is named by its full path, such as "a/b/file", and every
+ * component but the last one must be an existing directory
+ * made with ufs_mkdir(). A leading '/' is allowed and changes
+ * nothing, "/a/b/file" is the same file. A path is looked up
+ * whole in one hash index, without walking its components, and
+ * each directory links the files right under it for listing.
+ *
+ * All functions are thread-safe. A single descriptor should be
+ * used by one thread at a time.
  */
 
 /**
@@ -32,7 +40,8 @@
 enum open_flags {
   /**
    * If the flag specified and a file does not exist -
-   * create it.
+   * create it. Combines with the flags below, without an
+   * access flag it allows reading and writing.
    */
   UFS_CREATE = 1,
 
@@ -52,6 +61,13 @@ enum open_flags {
    * into the file.
    */
   UFS_READ_WRITE = 8,
+  /**
+   * Writes through the descriptor go to the end of the file,
+   * wherever its position is. Combined with any of the flags
+   * above, alone it allows reading and writing.
+   * ufs_pwrite() still writes at the given offset.
+   */
+  UFS_APPEND = 16,
 
 #endif
 };
@@ -67,21 +83,30 @@ enum ufs_error_code {
 
   UFS_ERR_NO_PERMISSION,
 #endif
+  UFS_ERR_INVALID_ARG,
+  UFS_ERR_IO,
+  UFS_ERR_EXISTS,
+  UFS_ERR_IS_DIR,
+  UFS_ERR_NOT_EMPTY,
+  UFS_ERR_NOT_DIR,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error of the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
 /**
- * Open a file by filename.
+ * Open a file by filename. A name is a path from the root
+ * directory with components split by '/', like "dir/file". A
+ * file is created only in an existing directory.
  * @param filename Name of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified or there is no such directory.
+ *     - UFS_ERR_IS_DIR - the name is of a directory.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -114,6 +139,159 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given position. The position
+ * of the descriptor is not used and not changed. Writing past
+ * the end of the file fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given position. The position
+ * of the descriptor is not used and not changed, so several
+ * threads can read one descriptor at once.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write data gathered from @a iovcnt buffers, in order, as one
+ * write at the position of the descriptor.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the position of the descriptor, scattering it
+ * over @a iovcnt buffers in order.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to fill.
+ * @param iovcnt Number of buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Where ufs_lseek() counts the offset from. */
+enum ufs_whence {
+  /** From the file start. */
+  UFS_SEEK_SET,
+  /** From the position of the descriptor. */
+  UFS_SEEK_CUR,
+  /** From the file end. */
+  UFS_SEEK_END,
+  /** To the first data at or after the offset. */
+  UFS_SEEK_DATA,
+  /** To the first hole at or after the offset. */
+  UFS_SEEK_HOLE,
+};
+
+/**
+ * Move the position of the descriptor. Besides the usual
+ * modes, it finds data and holes of a sparse file: ranges
+ * never written and not backed by memory read as zeros. The
+ * end of the file counts as a hole. Holes are found with the
+ * granularity of the file block size, so a block written with
+ * zeros is data.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in bytes, may be negative for
+ *     UFS_SEEK_CUR and UFS_SEEK_END.
+ * @param whence How to count the offset.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - the position would be negative,
+ *       or for UFS_SEEK_DATA and UFS_SEEK_HOLE the offset is
+ *       not in the file or there is no data after it.
+ */
+off_t
+ufs_lseek(int fd, off_t offset, int whence);
+
+/**
+ * Same as ufs_lseek(), but only returns the position and leaves
+ * the one of the descriptor as it is, so that a descriptor
+ * shared by several threads can be asked for the size, data
+ * and holes.
+ */
+off_t
+ufs_pseek(int fd, off_t offset, int whence);
+
+/** Read-only view of file data from ufs_read_view(). */
+struct ufs_view {
+  /** Start of the data. */
+  const char *data;
+  /** How many bytes the view has. */
+  size_t size;
+  /** Keeps the data alive until ufs_release_view(). */
+  void *block;
+};
+
+/**
+ * Read data from the position of the descriptor without copying
+ * it. The view points right into the file memory and spans at
+ * most up to the end of the block holding the position, so a
+ * scan calls this in a loop. The position moves past the view.
+ * The view stays valid and unchanged until released, even if
+ * the file is written, truncated or deleted meanwhile.
+ * @param fd File descriptor from ufs_open().
+ * @param[out] view Filled with the data. Must be released with
+ *     ufs_release_view() once not needed.
+ *
+ * @retval > 0 How many bytes the view has.
+ * @retval 0 EOF, the view is empty.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_read_view(int fd, struct ufs_view *view);
+
+/**
+ * Same as ufs_read_view(), but the view is of the data at
+ * @a offset and the position of the descriptor does not move.
+ */
+ssize_t
+ufs_pread_view(int fd, struct ufs_view *view, size_t offset);
+
+/**
+ * Release a view from ufs_read_view(). Releasing an empty view
+ * does nothing.
+ * @param view View to release.
+ */
+void
+ufs_release_view(struct ufs_view *view);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -132,13 +310,158 @@ ufs_close(int fd);
  * same name immediately and it should not affect existing opened
  * descriptors of the deleted file.
  *
+ * An empty directory is deleted the same way.
+ *
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has files.
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory.
+ * @param path Path of the directory, its parent must exist.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - a file or a directory has this path.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/** Opened directory, see ufs_opendir(). */
+struct ufs_dir;
+
+/**
+ * Open a directory to list its files. The listing is the one
+ * of the moment of the call and costs only the files of the
+ * directory.
+ * @param path Path of the directory, "" or "/" for the root.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is of a file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Get the next name of an opened directory, the last component
+ * of the path of a file or a directory in it. The names come
+ * in no particular order.
+ * @param dir Directory from ufs_opendir().
+ * @retval NULL No more names.
+ */
+const char *
+ufs_readdir(struct ufs_dir *dir);
+
+/**
+ * Close a directory. The names it returned become invalid.
+ * @param dir Directory from ufs_opendir().
+ */
+void
+ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Back the file system with an image file. If the file exists,
+ * the files stored in it are loaded: the image is mapped into
+ * memory and used in place, so loading costs the same however
+ * much data there is. Changes are not written to the image
+ * until ufs_sync(). Must be called while there are no files.
+ * @param path Path of the image file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - there are files already.
+ *     - UFS_ERR_IO - the image can't be read or is damaged,
+ *       no files are loaded then.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mount(const char *path);
+
+/**
+ * Write all files to the image file given to ufs_mount(). The
+ * image is replaced atomically, a crash leaves the previous
+ * one. Every file is saved as it is at some moment of the
+ * call; files deleted but still opened are not saved.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no image file is set.
+ *     - UFS_ERR_IO - the image can't be written.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_sync(void);
+
+/** Memory usage of the file system. */
+struct ufs_stats {
+  /** Bytes mapped for file blocks, file headers and the image. */
+  size_t mapped_bytes;
+  /** Bytes of blocks holding file data. */
+  size_t block_bytes;
+  /** Blocks holding file data. */
+  size_t blocks_used;
+  /** Mapped blocks waiting for reuse. */
+  size_t blocks_free;
+  /** Files and directories, including deleted files still opened. */
+  size_t files;
+};
+
+/**
+ * Make file @a dst a copy of file @a src. The copy shares the
+ * blocks of the source and costs only the block table. A block
+ * is copied on the first write to it through either file, so
+ * memory grows only with the blocks the files differ in. An
+ * existing @a dst is replaced, its descriptors stay opened, and
+ * a missing one is created.
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file named @a src, or no
+ *       directory for @a dst.
+ *     - UFS_ERR_IS_DIR - either name is of a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory, @a dst is empty
+ *       then.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Set the block size of a file. Files are stored in blocks of
+ * 64 KiB by default. Bigger blocks suit big files read and
+ * written in big chunks, smaller ones save memory of files
+ * written sparsely. Holes of a file, ranges never written,
+ * take no blocks.
+ * @param fd File descriptor from ufs_open().
+ * @param block_size Power of two from 4 KiB to 2 MiB.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - the size is not supported or
+ *       the file is not empty.
+ */
+int
+ufs_set_block_size(int fd, size_t block_size);
+
+/**
+ * Set the limit of the file size, 1 GiB by default. Writes are
+ * cut and resizes fail at the limit. Files already bigger keep
+ * their data.
+ * @param size New limit in bytes.
+ */
+void
+ufs_set_max_file_size(size_t size);
+
+/**
+ * Get memory usage of the file system.
+ * @param[out] stats Filled with the current numbers.
+ */
+void
+ufs_get_stats(struct ufs_stats *stats);
+
 #ifdef NEED_RESIZE
 
 /**
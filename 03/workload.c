@@ -0,0 +1,407 @@
+#include "userfs.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/**
+ * Workload generator for userfs in the spirit of fio. Every
+ * operation is timed on its own, and every workload is reported
+ * as a JSON object with operations and MiB per second, latency
+ * percentiles and the peak RSS of the process while it ran, so
+ * that runs can be saved and compared to catch regressions.
+ *
+ * Workloads:
+ *     seq_write  - write a file of --size in --bs chunks.
+ *     seq_read   - read that file back in --bs chunks.
+ *     rand_read  - --ops preads of --bs at random offsets.
+ *     churn      - --ops times create a file, write --bs into
+ *                  it, close and delete it, among --files
+ *                  other files.
+ *     open_close - --ops opens and closes of a file by name
+ *                  while --fds descriptors are open.
+ *     resize     - --ops resizes of a file to random sizes up
+ *                  to --size while --fds descriptors are open.
+ *
+ * Usage: workload.out [--workloads=name,name...] [--size=MiB]
+ *                     [--bs=bytes] [--ops=n] [--files=n]
+ *                     [--fds=n]
+ * All workloads run by default, on a file of 256 MiB in chunks
+ * of 4 KiB, with 100000 operations, 10000 files and 10000
+ * descriptors.
+ */
+
+struct config {
+  const char *workloads;
+  size_t size;
+  size_t bs;
+  size_t ops;
+  size_t files;
+  size_t fds;
+};
+
+/** Latencies of the operations of a workload, nanoseconds. */
+struct samples {
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+  size_t bytes;
+  uint64_t start;
+};
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+xmalloc(size_t size)
+{
+  void *p = malloc(size);
+  if (p == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static uint64_t
+next_random(uint64_t *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+/**
+ * Reset the peak RSS of the process, so that the next workload
+ * reports its own peak. Not every kernel allows it, then the
+ * peak of the whole run so far is reported.
+ */
+static void
+reset_peak_rss(void)
+{
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+/** Peak RSS in KiB, since the last reset if it worked. */
+static long
+peak_rss_kib(void)
+{
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[256];
+  long kib = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "VmHWM: %ld kB", &kib) == 1) {
+      break;
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  if (kib == -1) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    kib = usage.ru_maxrss;
+  }
+  return kib;
+}
+
+static void
+samples_begin(struct samples *s, size_t capacity)
+{
+  s->ns = xmalloc(capacity * sizeof(*s->ns));
+  s->count = 0;
+  s->capacity = capacity;
+  s->bytes = 0;
+  reset_peak_rss();
+  s->start = now_ns();
+}
+
+static void
+samples_add(struct samples *s, uint64_t start, ssize_t bytes)
+{
+  uint64_t end = now_ns();
+  if (s->count < s->capacity) {
+    s->ns[s->count++] = end - start;
+  }
+  s->bytes += bytes > 0 ? bytes : 0;
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const struct samples *s, double p)
+{
+  size_t i = (size_t)(p / 100 * s->count);
+  return s->ns[i < s->count ? i : s->count - 1];
+}
+
+/**
+ * Print a workload as one JSON object of the "results" array and
+ * free its samples.
+ */
+static void
+samples_report(struct samples *s, const char *name, bool *first)
+{
+  double sec = (now_ns() - s->start) / 1e9;
+  long rss = peak_rss_kib();
+  struct ufs_stats stats;
+  ufs_get_stats(&stats);
+  qsort(s->ns, s->count, sizeof(*s->ns), compare_ns);
+  printf("%s\n    {\"workload\": \"%s\", \"ops\": %zu, \"bytes\": %zu, "
+         "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mib_per_sec\": %.1f,\n"
+         "     \"latency_ns\": {", *first ? "" : ",", name, s->count,
+         s->bytes, sec, s->count / sec, s->bytes / sec / (1024 * 1024));
+  if (s->count > 0) {
+    printf("\"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p99.9\": %llu, \"max\": %llu",
+           (unsigned long long)s->ns[0],
+           (unsigned long long)percentile(s, 50),
+           (unsigned long long)percentile(s, 90),
+           (unsigned long long)percentile(s, 99),
+           (unsigned long long)percentile(s, 99.9),
+           (unsigned long long)s->ns[s->count - 1]);
+  }
+  printf("},\n     \"peak_rss_kib\": %ld, \"mapped_bytes\": %zu}", rss,
+         stats.mapped_bytes);
+  fflush(stdout);
+  *first = false;
+  free(s->ns);
+}
+
+static void
+run_seq_write(const struct config *cfg, struct samples *s)
+{
+  char *buf = xmalloc(cfg->bs);
+  memset(buf, 'x', cfg->bs);
+  ufs_delete("bench");
+  int fd = ufs_open("bench", UFS_CREATE);
+  samples_begin(s, cfg->size / cfg->bs + 1);
+  while (s->bytes < cfg->size) {
+    uint64_t start = now_ns();
+    ssize_t rc = ufs_write(fd, buf, cfg->bs);
+    samples_add(s, start, rc);
+    if (rc <= 0) {
+      break;
+    }
+  }
+  ufs_close(fd);
+  free(buf);
+}
+
+static void
+run_seq_read(const struct config *cfg, struct samples *s)
+{
+  char *buf = xmalloc(cfg->bs);
+  int fd = ufs_open("bench", 0);
+  samples_begin(s, cfg->size / cfg->bs + 1);
+  while (true) {
+    uint64_t start = now_ns();
+    ssize_t rc = ufs_read(fd, buf, cfg->bs);
+    if (rc <= 0) {
+      break;
+    }
+    samples_add(s, start, rc);
+  }
+  ufs_close(fd);
+  free(buf);
+}
+
+static void
+run_rand_read(const struct config *cfg, struct samples *s)
+{
+  char *buf = xmalloc(cfg->bs);
+  int fd = ufs_open("bench", 0);
+  size_t chunks = cfg->size / cfg->bs;
+  uint64_t seed = 88172645463325252ULL;
+  samples_begin(s, cfg->ops);
+  for (size_t i = 0; i < cfg->ops && chunks > 0; ++i) {
+    size_t offset = next_random(&seed) % chunks * cfg->bs;
+    uint64_t start = now_ns();
+    ssize_t rc = ufs_pread(fd, buf, cfg->bs, offset);
+    samples_add(s, start, rc);
+  }
+  ufs_close(fd);
+  free(buf);
+}
+
+static void
+run_churn(const struct config *cfg, struct samples *s)
+{
+  char name[32];
+  char *buf = xmalloc(cfg->bs);
+  memset(buf, 'x', cfg->bs);
+  for (size_t i = 0; i < cfg->files; ++i) {
+    sprintf(name, "file%zu", i);
+    ufs_close(ufs_open(name, UFS_CREATE));
+  }
+  samples_begin(s, cfg->ops);
+  for (size_t i = 0; i < cfg->ops; ++i) {
+    sprintf(name, "churn%zu", i % 64);
+    uint64_t start = now_ns();
+    int fd = ufs_open(name, UFS_CREATE);
+    ssize_t rc = ufs_write(fd, buf, cfg->bs);
+    ufs_close(fd);
+    ufs_delete(name);
+    samples_add(s, start, rc);
+  }
+  for (size_t i = 0; i < cfg->files; ++i) {
+    sprintf(name, "file%zu", i);
+    ufs_delete(name);
+  }
+  free(buf);
+}
+
+static int *
+open_many(size_t count)
+{
+  int *fds = xmalloc((count + 1) * sizeof(int));
+  for (size_t i = 0; i < count; ++i) {
+    fds[i] = ufs_open("other", UFS_CREATE);
+  }
+  return fds;
+}
+
+static void
+close_many(int *fds, size_t count)
+{
+  for (size_t i = 0; i < count; ++i) {
+    ufs_close(fds[i]);
+  }
+  ufs_delete("other");
+  free(fds);
+}
+
+static void
+run_open_close(const struct config *cfg, struct samples *s)
+{
+  int *fds = open_many(cfg->fds);
+  samples_begin(s, cfg->ops);
+  for (size_t i = 0; i < cfg->ops; ++i) {
+    uint64_t start = now_ns();
+    ufs_close(ufs_open("bench", 0));
+    samples_add(s, start, 0);
+  }
+  close_many(fds, cfg->fds);
+}
+
+static void
+run_resize(const struct config *cfg, struct samples *s)
+{
+  int *fds = open_many(cfg->fds);
+  int fd = ufs_open("bench", 0);
+  uint64_t seed = 88172645463325252ULL;
+  samples_begin(s, cfg->ops);
+  for (size_t i = 0; i < cfg->ops; ++i) {
+    size_t size = next_random(&seed) % (cfg->size + 1);
+    uint64_t start = now_ns();
+    ufs_resize(fd, size);
+    samples_add(s, start, 0);
+  }
+  ufs_close(fd);
+  close_many(fds, cfg->fds);
+}
+
+static const struct {
+  const char *name;
+  void (*run)(const struct config *cfg, struct samples *s);
+} workloads[] = {
+  {"seq_write", run_seq_write},
+  {"seq_read", run_seq_read},
+  {"rand_read", run_rand_read},
+  {"churn", run_churn},
+  {"open_close", run_open_close},
+  {"resize", run_resize},
+};
+
+/** Whether @a name is in the comma separated @a list. */
+static bool
+selected(const char *list, const char *name)
+{
+  size_t len = strlen(name);
+  for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+    p += *p == ',';
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Parse "--key=value" into *value if the argument is for @a key. */
+static bool
+parse_size(const char *arg, const char *key, size_t *value)
+{
+  size_t len = strlen(key);
+  if (strncmp(arg, key, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  *value = strtoull(arg + len + 1, NULL, 10);
+  return true;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct config cfg = {"seq_write,seq_read,rand_read,churn,open_close,resize",
+                       256, 4096, 100000, 10000, 10000};
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--workloads=", 12) == 0) {
+      cfg.workloads = argv[i] + 12;
+    } else if (!parse_size(argv[i], "--size", &cfg.size) &&
+               !parse_size(argv[i], "--bs", &cfg.bs) &&
+               !parse_size(argv[i], "--ops", &cfg.ops) &&
+               !parse_size(argv[i], "--files", &cfg.files) &&
+               !parse_size(argv[i], "--fds", &cfg.fds)) {
+      fprintf(stderr, "unknown argument %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (cfg.bs == 0) {
+    fprintf(stderr, "--bs must be positive\n");
+    return EXIT_FAILURE;
+  }
+  cfg.size *= 1024 * 1024;
+  ufs_set_max_file_size(cfg.size > 1024 * 1024 * 1024 ? cfg.size : 1024 * 1024 * 1024);
+  printf("{\"config\": {\"size\": %zu, \"bs\": %zu, \"ops\": %zu, "
+         "\"files\": %zu, \"fds\": %zu},\n \"results\": [", cfg.size, cfg.bs,
+         cfg.ops, cfg.files, cfg.fds);
+  bool first = true;
+  /*
+   * The read and resize workloads need the file seq_write
+   * leaves, it is written unmeasured if seq_write is not run.
+   */
+  if (!selected(cfg.workloads, "seq_write")) {
+    struct samples s;
+    run_seq_write(&cfg, &s);
+    free(s.ns);
+  }
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+    if (selected(cfg.workloads, workloads[i].name)) {
+      struct samples s;
+      workloads[i].run(&cfg, &s);
+      samples_report(&s, workloads[i].name, &first);
+    }
+  }
+  printf("\n ]}\n");
+  ufs_delete("bench");
+  return 0;
+}